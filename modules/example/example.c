@@ -12,23 +12,60 @@
  *   prints time in seconds elapsed since loading module
  * 
  * - Read from device
- *   example_read: copy_to_user
+ *   example_read_iter: copy_to_iter, used by read(), readv(), io_uring and splice()
  * 
  * - Write to device: 
- *   example_write: 
+ *   example_write_iter: copy_from_iter, used by write(), writev(), io_uring and splice()
+ *   (so sendfile() and copy_file_range() work in both directions without a userspace buffer).
+ *   IOCB_NOWAIT requests (Linux 4.13+) return -EAGAIN instead of waiting for data, room or a lock
  * 
  * - ioctl:
  *   example_ioctl - two commands implemented, to set  uppercase and lowercase of string in example_buffer
+ *   EXAMPLE_IOCTL_UPPER_RANGE/LOWER_RANGE convert ASCII letters in {offset, length}, 8 bytes per step (SWAR),
+ *   and return number of changed bytes
+ * 
+ * - Streaming transforms (EXAMPLE_IOCTL_SET_XFORM, per open file): case folding, XOR and user byte table,
+ *   composed into one 256-entry lookup table, and running CRC-32/XXH64 checksums (EXAMPLE_IOCTL_GET_CSUM)
+ *   are applied while data is copied by read/write, without another pass over the buffer.
+ *   XXH64 is available only if the kernel has lib/xxhash (CONFIG_XXHASH, Linux 4.14+), otherwise it is -EOPNOTSUPP
+ * 
+ * - Tracepoints char_example:example_rw and char_example:example_ioctl (example_trace.h) record every call
+ *   with its result and duration; the I/O path does not printk
  * 
  * - Add proc interface (/proc/char_example) which gives time elapsed since loading module
+ *   and per-minor statistics: calls, bytes, -EFAULT/-EIO errors and log2 latency histogram of read, write and ioctl.
+ *   Counters are per-CPU and summed only when the file is read; writing to the file resets them
+ *   (echo 0 > /proc/char_example)
+ * 
+ * - Large buffer, mapped to userspace with mmap() (insmod example.ko buf_size=4194304)
+ *   example_mmap: remap_vmalloc_range; EXAMPLE_IOCTL_SYNC publishes a region written through the mapping
+ * 
+ * - FIFO mode (insmod example.ko mode=fifo fifo_size=65536)
+ *   example_read/example_write go through a kfifo ring buffer, block on wait queues
+ *   (or return -EAGAIN with O_NONBLOCK), and wake poll()/epoll() waiters
  * 
- * create device file after module is insmoded:
+ * - Log mode (insmod example.ko mode=log log_size=65536)
+ *   every write() is one timestamped record (struct example_log_hdr), appended without any lock to a ring
+ *   of the writer's CPU; read() merges the rings into one stream in timestamp order. Full rings drop records,
+ *   counted in EXAMPLE_LOG_DROPS records, EXAMPLE_IOCTL_LOG_STATS and /proc/char_example
+ * 
+ * - Publish mode (insmod example.ko mode=publish buf_size=4096)
+ *   read-mostly buffer: every write() and case conversion ioctl fills a private copy and publishes it as
+ *   a new version with an RCU pointer swap. Readers take no lock, only an SRCU read side (per-CPU counters),
+ *   and always see one whole version; EXAMPLE_IOCTL_GET_GEN returns its generation number
+ * 
+ * - Multiple instances (insmod example.ko num_devices=4)
+ *   every minor has its own buffer (or FIFO), lock and statistics, so openers of different minors never share state;
+ *   example_open stores per-open context in file->private_data
+ * 
+ * create device files after module is insmoded:
  * cat /proc/devices shows:
  * 	245 char_example
  * then:
  * 	dev="char_example"
  * 	major="$(grep "$dev" /proc/devices | cut -d ' ' -f 1)"
  * 	mknod "/dev/$dev" c "$major" 0
+ * 	mknod "/dev/${dev}1" c "$major" 1    (and so on, one per minor)
  * 
  * DOCUMENTATION:
  * - http://tldp.org/LDP/lkmpg/2.6/html/index.html
@@ -46,8 +83,33 @@
 #include <linux/seq_file.h>
 #include <linux/jiffies.h>
 #include <linux/ctype.h> //toupper, tolower
+#include <linux/kfifo.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/bitops.h>
+#include <linux/slab.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/ktime.h>
+#include <linux/uio.h>
+#include <linux/scatterlist.h>
+#include <linux/crc32.h>
+#if IS_ENABLED(CONFIG_XXHASH)
+#include <linux/xxhash.h>
+#define EXAMPLE_HAVE_XXH64
+#endif
+#include <linux/rcupdate.h>
+#include <linux/srcu.h>
 #include <generated/utsrelease.h> //UTS_RELEASE
 #include "example_ioctl.h"
+#define CREATE_TRACE_POINTS
+#include "example_trace.h"
 
 /* Module parameter*/
 static int int_param = 1;
@@ -59,22 +121,174 @@ MODULE_PARM_DESC(string_param, "Example of char* module parameter");
 module_param(int_param, int, 0644);
 module_param(string_param, charp, 0644);
 
+/* Device mode: "buffer" - position based access to device buffer (default), "fifo" - blocking ring buffer,
+ * "log" - record per write, merged from per-CPU rings, "publish" - buffer replaced by whole versions */
+static char *mode = "buffer";
+MODULE_PARM_DESC(mode, "Device mode: buffer, fifo, log or publish");
+module_param(mode, charp, 0444);
+/* Size of every device buffer in bytes; buffer is page backed (vmalloc), so it can be megabytes and mmap()-ed */
+static int buf_size = 100;
+MODULE_PARM_DESC(buf_size, "Buffer mode device size in bytes");
+module_param(buf_size, int, 0444);
+/* FIFO capacity in bytes, rounded up to power of two */
+static int fifo_size = 4096;
+MODULE_PARM_DESC(fifo_size, "FIFO mode buffer size in bytes (rounded up to power of two)");
+module_param(fifo_size, int, 0444);
+/* Log ring size of every CPU in bytes, rounded up to power of two */
+static int log_size = 65536;
+MODULE_PARM_DESC(log_size, "Log mode buffer size per CPU in bytes (rounded up to power of two)");
+module_param(log_size, int, 0444);
+
 /* User-defined macros */
-#define NUM_OF_DEVICES 1
+#define MAX_NUM_OF_DEVICES 64
 #define DEVICE_NAME "char_example"
 
+/* Number of minors, every one is an independent device */
+static int num_devices = 1;
+MODULE_PARM_DESC(num_devices, "Number of device instances (minors), 1 - 64");
+module_param(num_devices, int, 0444);
+
 
 /* Global module variables*/
 
 /* Kernel data type to represent a major / minor number pair */
 static dev_t example_dev;
-/* The kernel represents character drivers with a cdev structure */
-static struct cdev example_cdev;
-
 
 static struct timeval load_time;
-static char example_buf[100];
-static int example_bufsize = 100;
+
+enum example_mode {
+	EXAMPLE_MODE_BUFFER,
+	EXAMPLE_MODE_FIFO,
+	EXAMPLE_MODE_LOG,
+	EXAMPLE_MODE_PUBLISH
+};
+static enum example_mode example_mode;
+
+/* Operations with statistics */
+enum example_op {
+	EXAMPLE_OP_READ,
+	EXAMPLE_OP_WRITE,
+	EXAMPLE_OP_IOCTL,
+	EXAMPLE_NUM_OPS
+};
+static const char * const example_op_names[EXAMPLE_NUM_OPS] = { "read", "write", "ioctl" };
+
+/* lat_hist[i] counts calls that took [2^(i-1), 2^i) ns, the last bucket also everything longer */
+#define EXAMPLE_LAT_HIST_SIZE 32
+
+struct example_op_stats {
+	u64 calls;
+	u64 bytes;
+	u64 efault;
+	u64 eio;
+	u64 lat_hist[EXAMPLE_LAT_HIST_SIZE];
+};
+
+/* Updated only by the owning CPU with preemption disabled, so the hot path takes no shared lock.
+ * syncp lets the reader get consistent 64-bit values on 32-bit CPUs. */
+struct example_cpu_stats {
+	struct example_op_stats op[EXAMPLE_NUM_OPS];
+	struct u64_stats_sync syncp;
+};
+
+/* Serializes /proc/char_example readers and resets, never taken on the I/O path */
+static DEFINE_MUTEX(example_stats_lock);
+
+/* Log ring of one CPU. Only tasks running on that CPU append to it, with preemption disabled,
+ * so producers need no lock; the reader holds read_lock. head and tail are free running byte counters. */
+struct example_log_cpu {
+	char *data;
+	unsigned int head;		/* end of published records, smp_store_release() by the producer */
+	unsigned int tail;		/* end of consumed records, smp_store_release() by the reader */
+	u64 pending_ts;			/* timestamp of the record being appended, EXAMPLE_LOG_CLAIM before it is taken, 0 if none */
+	unsigned int lost;		/* records dropped since the last EXAMPLE_LOG_DROPS record */
+	u64 records;
+	u64 dropped;
+	struct u64_stats_sync syncp;
+};
+
+/* Publish mode: one version of the buffer, never changed after it was published */
+struct example_snapshot {
+	struct rcu_head rcu;
+	u64 generation;
+	int len;
+	char data[];
+};
+
+/* One instance per minor */
+struct example_device {
+	/* The kernel represents character drivers with a cdev structure */
+	struct cdev cdev;
+	int minor;
+
+	/* Buffer mode: lock serializes read/write/ioctl on buf */
+	char *buf;
+	int bufsize;
+	struct mutex lock;
+
+	/* FIFO mode: kfifo is safe for one reader and one writer without locking,
+	 * so readers are serialized only against readers and writers against writers */
+	struct kfifo fifo;
+	struct mutex read_lock;
+	struct mutex write_lock;
+	wait_queue_head_t readq;
+	wait_queue_head_t writeq;
+
+	/* Log mode: rings of all CPUs, read_lock and readq are shared with FIFO mode */
+	struct example_log_cpu __percpu *log;
+	unsigned int log_size;
+
+	/* Publish mode: readers only hold srcu, writers (read-modify-publish) are serialized by write_lock */
+	struct example_snapshot __rcu *snap;
+	struct srcu_struct srcu;
+
+	/* Statistics, shown in /proc/char_example */
+	atomic_t opens;
+	struct example_cpu_stats __percpu *stats;
+	/* totals at the last reset, subtracted when shown; protected by example_stats_lock */
+	struct example_op_stats stats_base[EXAMPLE_NUM_OPS];
+};
+
+#define EXAMPLE_XFORM_BYTEMAP	(EXAMPLE_XFORM_UPPER | EXAMPLE_XFORM_LOWER | EXAMPLE_XFORM_XOR | EXAMPLE_XFORM_MAP)
+#define EXAMPLE_XFORM_ALL		(EXAMPLE_XFORM_BYTEMAP | EXAMPLE_XFORM_CRC32 | EXAMPLE_XFORM_XXH64)
+
+enum example_dir {
+	EXAMPLE_DIR_READ,
+	EXAMPLE_DIR_WRITE,
+	EXAMPLE_NUM_DIRS
+};
+
+/* Transform chain of one direction of an open file */
+struct example_xform_state {
+	unsigned int flags;		/* EXAMPLE_XFORM_* */
+	u8 lut[256];			/* all byte mappings of flags composed, used if any is set */
+	u32 crc;				/* crc32_le() state, seeded with ~0 */
+#ifdef EXAMPLE_HAVE_XXH64
+	struct xxh64_state xxh;
+#endif
+	u64 bytes;
+};
+
+/* Per-open context, kept in file->private_data */
+struct example_file {
+	struct example_device *dev;
+
+	/* Transforms are changed by ioctl with all I/O locks of the device held,
+	 * so read and write use them under the lock they take anyway */
+	struct example_xform_state xform[EXAMPLE_NUM_DIRS];
+	u8 xor_key;
+	u8 map[256];
+	/* Read side byte mappings must not change device data, they go through this page; allocated on demand */
+	u8 *bounce;
+};
+
+static inline struct example_device *example_file_dev(struct file *file)
+{
+	return ((struct example_file *)file->private_data)->dev;
+}
+
+static struct example_device *example_devices;
+static int example_num_devices;
 
 
 /**************************************************************
@@ -82,20 +296,32 @@ static int example_bufsize = 100;
  * ***********************************************************/
 static int example_proc_open(struct inode *inode, struct file *file);
 static int example_proc_show(struct seq_file *m, void *v); 
+static ssize_t example_proc_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos);
 
-static ssize_t example_read(struct file *file, char __user *buf, size_t count, loff_t * ppos);
-static ssize_t example_write(struct file *file, const char __user *buf, size_t count, loff_t * ppos);
+static int example_open(struct inode *inode, struct file *file);
+static int example_release(struct inode *inode, struct file *file);
+static ssize_t example_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t example_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static ssize_t example_buf_read(struct example_file *ctx, struct kiocb *iocb, struct iov_iter *to);
+static ssize_t example_buf_write(struct example_file *ctx, struct kiocb *iocb, struct iov_iter *from);
 static long example_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static unsigned int example_poll(struct file *file, poll_table *wait);
+static int example_mmap(struct file *file, struct vm_area_struct *vma);
 
 /* File operation structure */
-/* Defaults for other functions (such as open, release...)
-   are fine if you do not implement anything special */
 static struct file_operations example_fops = {
 	.owner = THIS_MODULE,
-	.read = example_read,
-	.write = example_write,
+	.open = example_open,
+	.release = example_release,
+	/* read()/write() go through the iter methods too */
+	.read_iter = example_read_iter,
+	.write_iter = example_write_iter,
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
 	/* ioctl has been renamed to unlocked_ioctl. E.g, http://www.cs.otago.ac.nz/cosc440/labs/lab06.pdf */
-	.unlocked_ioctl = example_ioctl
+	.unlocked_ioctl = example_ioctl,
+	.poll = example_poll,
+	.mmap = example_mmap
 };
 
 /* proc file operations */
@@ -103,207 +329,1691 @@ static const struct file_operations example_proc_fops = {
     .owner      = THIS_MODULE,
     .open       = example_proc_open,
     .read       = seq_read,
-//    .llseek     = seq_lseek,
-//    .release    = single_release,
+    .write      = example_proc_write,
+    .llseek     = seq_lseek,
+    .release    = single_release,
 };
 
 /* proc dir entry */
 struct proc_dir_entry *pde;
  
+/**************************************************************
+ * Log rings, allocated on the memory node of their CPU
+ * ***********************************************************/
+static void example_log_free(struct example_device *dev)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		vfree(per_cpu_ptr(dev->log, cpu)->data);
+	free_percpu(dev->log);
+}
+
+static int example_log_alloc(struct example_device *dev)
+{
+	struct example_log_cpu *c;
+	int cpu;
+
+	if (log_size <= 0)
+		return -EINVAL;
+	dev->log_size = roundup_pow_of_two(max(log_size, 4096));
+	dev->log = alloc_percpu(struct example_log_cpu);
+	if (!dev->log)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		c = per_cpu_ptr(dev->log, cpu);
+		u64_stats_init(&c->syncp);
+		c->data = vmalloc_node(dev->log_size, cpu_to_node(cpu));
+		if (!c->data) {
+			example_log_free(dev);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+
+/**************************************************************
+ * Publish mode versions. Old versions are freed after an SRCU grace period, when no reader can use them.
+ * ***********************************************************/
+static void example_snap_free_rcu(struct rcu_head *rcu)
+{
+	vfree(container_of(rcu, struct example_snapshot, rcu));
+}
+
+static struct example_snapshot *example_snap_alloc(int len)
+{
+	struct example_snapshot *s = vmalloc(sizeof(*s) + len);
+
+	if (s)
+		s->len = len;
+	return s;
+}
+
+static int example_pub_alloc(struct example_device *dev)
+{
+	struct example_snapshot *s;
+
+	s = example_snap_alloc(dev->bufsize);
+	if (!s)
+		return -ENOMEM;
+	if (init_srcu_struct(&dev->srcu)) {
+		vfree(s);
+		return -ENOMEM;
+	}
+	s->generation = 0;
+	memcpy(s->data, dev->buf, dev->bufsize);
+	RCU_INIT_POINTER(dev->snap, s);
+	return 0;
+}
+
+static void example_pub_free(struct example_device *dev)
+{
+	/* wait for callbacks freeing old versions */
+	srcu_barrier(&dev->srcu);
+	vfree(rcu_dereference_protected(dev->snap, true));
+	cleanup_srcu_struct(&dev->srcu);
+}
+
+
+/**************************************************************
+ * static int example_device_setup(struct example_device *dev, int minor)
+ * 
+ * Allocates buffer (and FIFO or log rings) of one instance, cdev is added later
+ * ***********************************************************/
+static int example_device_setup(struct example_device *dev, int minor)
+{
+	int cpu;
+
+	dev->minor = minor;
+	mutex_init(&dev->lock);
+	mutex_init(&dev->read_lock);
+	mutex_init(&dev->write_lock);
+	init_waitqueue_head(&dev->readq);
+	init_waitqueue_head(&dev->writeq);
+
+	dev->stats = alloc_percpu(struct example_cpu_stats);
+	if (!dev->stats)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(dev->stats, cpu)->syncp);
+
+	if (example_mode == EXAMPLE_MODE_FIFO) {
+		if (fifo_size <= 0 || kfifo_alloc(&dev->fifo, roundup_pow_of_two(fifo_size), GFP_KERNEL)) {
+			printk(KERN_ERR "Cannot allocate FIFO of %d bytes\n", fifo_size);
+			free_percpu(dev->stats);
+			return -ENOMEM;
+		}
+	}
+	if (example_mode == EXAMPLE_MODE_LOG && example_log_alloc(dev)) {
+		printk(KERN_ERR "Cannot allocate log buffers of %d bytes\n", log_size);
+		free_percpu(dev->stats);
+		return -ENOMEM;
+	}
+
+	/* vmalloc_user() memory is zeroed and page aligned, so it can be mapped with remap_vmalloc_range() */
+	dev->bufsize = buf_size;
+	dev->buf = dev->bufsize > 0 ? vmalloc_user(dev->bufsize) : NULL;
+	if (!dev->buf) {
+		printk(KERN_ERR "Cannot allocate buffer of %d bytes\n", buf_size);
+		if (example_mode == EXAMPLE_MODE_FIFO)
+			kfifo_free(&dev->fifo);
+		if (example_mode == EXAMPLE_MODE_LOG)
+			example_log_free(dev);
+		free_percpu(dev->stats);
+		return -ENOMEM;
+	}
+
+	strncpy(dev->buf, "Initial string", dev->bufsize);
+
+	if (example_mode == EXAMPLE_MODE_PUBLISH && example_pub_alloc(dev)) {
+		printk(KERN_ERR "Cannot allocate buffer version of %d bytes\n", buf_size);
+		vfree(dev->buf);
+		free_percpu(dev->stats);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+
+/**************************************************************
+ * static void example_device_free(struct example_device *dev)
+ * 
+ * ***********************************************************/
+static void example_device_free(struct example_device *dev)
+{
+	vfree(dev->buf);
+	if (example_mode == EXAMPLE_MODE_FIFO)
+		kfifo_free(&dev->fifo);
+	if (example_mode == EXAMPLE_MODE_LOG)
+		example_log_free(dev);
+	if (example_mode == EXAMPLE_MODE_PUBLISH)
+		example_pub_free(dev);
+	free_percpu(dev->stats);
+}
+
+
 /**************************************************************
  * static int __init example_init(void)
  * 
  * ***********************************************************/
 static int __init example_init(void)
 {
+	int err, i, added = 0;
+
+	if (strcmp(mode, "buffer") == 0) {
+		example_mode = EXAMPLE_MODE_BUFFER;
+	}
+	else if (strcmp(mode, "fifo") == 0) {
+		example_mode = EXAMPLE_MODE_FIFO;
+	}
+	else if (strcmp(mode, "log") == 0) {
+		example_mode = EXAMPLE_MODE_LOG;
+	}
+	else if (strcmp(mode, "publish") == 0) {
+		example_mode = EXAMPLE_MODE_PUBLISH;
+	}
+	else {
+		printk(KERN_ERR "Invalid mode: %s\n", mode);
+		return -EINVAL;
+	}
+
+	if (num_devices < 1 || num_devices > MAX_NUM_OF_DEVICES) {
+		printk(KERN_ERR "Invalid num_devices: %d\n", num_devices);
+		return -EINVAL;
+	}
+	example_num_devices = num_devices;
+
+	example_devices = kcalloc(example_num_devices, sizeof(*example_devices), GFP_KERNEL);
+	if (!example_devices)
+		return -ENOMEM;
+
+	for (i = 0; i < example_num_devices; i++) {
+		err = example_device_setup(&example_devices[i], i);
+		if (err)
+			goto err_free;
+	}
+
 	/* Dynamically register a character device major */
 	if (alloc_chrdev_region(&example_dev,              /* Output: starting device number */
 							0,                         /* Starting minor number, usually 0 */
-							NUM_OF_DEVICES,            /* Number of device numbers */
+							example_num_devices,       /* Number of device numbers */
 							DEVICE_NAME) < 0) {        /* Registered name */
 		printk(KERN_ERR "Cannot register device\n");
-		return -1;
+		err = -1;
+		goto err_free;
 	}
 	printk(KERN_INFO "Linux version: %s\n", UTS_RELEASE);
 	printk(KERN_INFO "Major number: %d\n", MAJOR(example_dev));
-	printk(KERN_INFO "Minor number: %d\n", MINOR(example_dev));
+	printk(KERN_INFO "Minor numbers: %d - %d\n", MINOR(example_dev), MINOR(example_dev) + example_num_devices - 1);
 	
-	/* - Initialise cdev with file operations */ 
-	cdev_init(&example_cdev, &example_fops);
+	for (added = 0; added < example_num_devices; added++) {
+		/* - Initialise cdev with file operations */ 
+		cdev_init(&example_devices[added].cdev, &example_fops);
+		example_devices[added].cdev.owner = THIS_MODULE;
 
-	/* Add char module to system, with previously allocated major and minor numbers */	
-	if (cdev_add(&example_cdev,       /* Character device structure */
-	             example_dev,         /* Starting device major / minor number */
-	             NUM_OF_DEVICES)) {   /* Number of devices */ 
-		printk(KERN_ERR "Char module registration failed\n");
+		/* Add char module to system, with previously allocated major and minor numbers */	
+		if (cdev_add(&example_devices[added].cdev,                     /* Character device structure */
+		             MKDEV(MAJOR(example_dev), MINOR(example_dev) + added), /* Device major / minor number */
+		             1)) {                                               /* Number of devices */ 
+			printk(KERN_ERR "Char module registration failed\n");
+			err = -1;
+			goto err_cdev;
+		}
 	}
 	
 	printk(KERN_INFO "Module parameter int_param: %d \n", int_param);
 	printk(KERN_INFO "Module parameter string_param: %s \n", string_param);
 	
-	pde = proc_create("char_example", 0, NULL, &example_proc_fops);
+	pde = proc_create("char_example", 0644, NULL, &example_proc_fops);
 	if (!pde) {
 		printk(KERN_ERR "Cannot create proc dir char_example!\n");
-		return -1;
+		err = -1;
+		goto err_cdev;
 	}
 	
 	/* get current time */
 	do_gettimeofday(&load_time);
 	printk(KERN_INFO "Char kernel module example initialized\n");
 	
-	strncpy(example_buf, "Initial string", example_bufsize);
 	return 0;
+
+err_cdev:
+	while (added--)
+		cdev_del(&example_devices[added].cdev);
+	unregister_chrdev_region(example_dev, example_num_devices);
+err_free:
+	while (i--)
+		example_device_free(&example_devices[i]);
+	kfree(example_devices);
+	return err;
 }
 
 
 /**************************************************************
- * static ssize_t example_read(struct file *file, char __user *buf, size_t count, loff_t * ppos)
+ * static int example_open(struct inode *inode, struct file *file)
  * 
+ * Instance is found from the cdev embedded in it
  * ***********************************************************/
-static ssize_t example_read(struct file *file, char __user *buf, size_t count, loff_t * ppos)
-{	
-	int remaining_size, transfer_size;
-	
-//	printk(KERN_INFO "ENTER example_read\n");
-	remaining_size = example_bufsize - (int)(*ppos);
-//	printk(KERN_INFO "example_bufsize: %d, *ppos: %llu, remaining_size: %d \n", example_bufsize, *ppos, remaining_size);
-	
-	/* bytes left to transfer */
-	if (remaining_size == 0) {
-		/* All read, returning 0 (End Of File) */
-		return 0;
+static int example_open(struct inode *inode, struct file *file)
+{
+	struct example_file *ctx;
+	int i;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+
+	ctx->dev = container_of(inode->i_cdev, struct example_device, cdev);
+	for (i = 0; i < sizeof(ctx->map); i++)
+		ctx->map[i] = i;
+	file->private_data = ctx;
+#ifdef FMODE_NOWAIT
+	/* read_iter/write_iter honour IOCB_NOWAIT, so io_uring and RWF_NOWAIT may be used */
+	file->f_mode |= FMODE_NOWAIT;
+#endif
+	atomic_inc(&ctx->dev->opens);
+	return 0;
+}
+
+
+/**************************************************************
+ * static int example_release(struct inode *inode, struct file *file)
+ * 
+ * ***********************************************************/
+static int example_release(struct inode *inode, struct file *file)
+{
+	struct example_file *ctx = file->private_data;
+
+	kfree(ctx->bounce);
+	kfree(ctx);
+	return 0;
+}
+
+
+/**************************************************************
+ * static bool example_iocb_nowait(struct kiocb *iocb)
+ * 
+ * IOCB_NOWAIT (RWF_NOWAIT, io_uring) exists from Linux 4.13; older kernels only have O_NONBLOCK
+ * ***********************************************************/
+static inline bool example_iocb_nowait(struct kiocb *iocb)
+{
+#ifdef IOCB_NOWAIT
+	return iocb->ki_flags & IOCB_NOWAIT;
+#else
+	return false;
+#endif
+}
+
+
+/**************************************************************
+ * static bool example_nowait(struct kiocb *iocb)
+ * 
+ * Request must not sleep waiting for data or room: O_NONBLOCK, or IOCB_NOWAIT (RWF_NOWAIT, io_uring)
+ * ***********************************************************/
+static bool example_nowait(struct kiocb *iocb)
+{
+	return (iocb->ki_filp->f_flags & O_NONBLOCK) || example_iocb_nowait(iocb);
+}
+
+
+/**************************************************************
+ * static int example_lock(struct mutex *lock, struct kiocb *iocb)
+ * 
+ * With IOCB_NOWAIT, even waiting for the lock would block the submitter, so only trylock
+ * ***********************************************************/
+static int example_lock(struct mutex *lock, struct kiocb *iocb)
+{
+	if (example_iocb_nowait(iocb))
+		return mutex_trylock(lock) ? 0 : -EAGAIN;
+	return mutex_lock_interruptible(lock) ? -ERESTARTSYS : 0;
+}
+
+
+/**************************************************************
+ * Streaming transforms
+ * 
+ * Data is transformed in the pass that copies it between the iterator and the device: written data in place,
+ * right after copy_from_iter() into the buffer or FIFO, read data PAGE_SIZE at a time through the bounce page.
+ * Only bytes really copied are checksummed, so after a short copy checksums still match what was transferred.
+ * ***********************************************************/
+static void example_xform_map(const struct example_xform_state *x, u8 *dst, const u8 *src, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		dst[i] = x->lut[src[i]];
+}
+
+static void example_xform_sum(struct example_xform_state *x, const u8 *p, size_t len)
+{
+	if (x->flags & EXAMPLE_XFORM_CRC32)
+		x->crc = crc32_le(x->crc, p, len);
+#ifdef EXAMPLE_HAVE_XXH64
+	if (x->flags & EXAMPLE_XFORM_XXH64)
+		xxh64_update(&x->xxh, p, len);
+#endif
+	x->bytes += len;
+}
+
+static size_t example_copy_from_iter(struct example_file *ctx, void *dst, size_t len, struct iov_iter *from)
+{
+	struct example_xform_state *x = &ctx->xform[EXAMPLE_DIR_WRITE];
+	size_t copied = copy_from_iter(dst, len, from);
+
+	if (x->flags) {
+		if (x->flags & EXAMPLE_XFORM_BYTEMAP)
+			example_xform_map(x, dst, dst, copied);
+		example_xform_sum(x, dst, copied);
 	}
-	
-	/* Size of this transfer */
-	transfer_size = min_t(int, remaining_size, count);
-//	printk(KERN_INFO "count: %d, transfer_size: %d \n", count, transfer_size);
+	return copied;
+}
 
-	if (copy_to_user(buf /* to */ , example_buf + *ppos/* from */ , transfer_size)) {
-		printk(KERN_ERR "ERROR, copy_to_user return -EFAULT \n");
-		return -EFAULT;
+static size_t example_copy_to_iter(struct example_file *ctx, const void *src, size_t len, struct iov_iter *to)
+{
+	struct example_xform_state *x = &ctx->xform[EXAMPLE_DIR_READ];
+	const u8 *p = src;
+	size_t copied = 0, chunk, n;
+
+	if (!(x->flags & EXAMPLE_XFORM_BYTEMAP)) {
+		copied = copy_to_iter(src, len, to);
+		if (x->flags)
+			example_xform_sum(x, src, copied);
+		return copied;
 	}
-	else {		
-		/* Increase the position in the open file */
-		*ppos += transfer_size;
-//		printk(KERN_INFO "OK, copy_to_user return %d \n", transfer_size);
-		return transfer_size;
+
+	while (copied < len) {
+		chunk = min_t(size_t, len - copied, PAGE_SIZE);
+		example_xform_map(x, ctx->bounce, p + copied, chunk);
+		n = copy_to_iter(ctx->bounce, chunk, to);
+		example_xform_sum(x, ctx->bounce, n);
+		copied += n;
+		if (n < chunk)
+			break;
 	}
+	return copied;
 }
 
 
 /**************************************************************
- * static ssize_t example_write(struct file *file, const char __user *buf, size_t count, loff_t * ppos)
+ * static ssize_t example_fifo_read(struct example_file *ctx, struct kiocb *iocb, struct iov_iter *to)
  * 
+ * Blocks while FIFO is empty, unless example_nowait().
+ * FIFO data (at most two linear pieces) is copied straight into the iterator: all iovec segments,
+ * or pipe pages for splice(), are filled in one call.
  * ***********************************************************/
-static ssize_t example_write(struct file *file, const char __user *buf, size_t count, loff_t * ppos)
-{	
-	/* Your code here */
-	int remaining_bytes;
-	
-//	printk(KERN_INFO "ENTER example_write\n");
-	
-	/* Number of bytes not written yet in the device */
-	remaining_bytes = example_bufsize - (*ppos);
-//	printk(KERN_INFO "example_bufsize: %d, *ppos: %llu, remaining_bytes: %d \n", example_bufsize, *ppos, remaining_bytes);
-	
-	if (count > remaining_bytes) {
-		printk(KERN_ALERT "Can't write beyond the end of the device, return -EIO\n");
-		/* Can't write beyond the end of the device */
-		return -EIO;
+static ssize_t example_fifo_read(struct example_file *ctx, struct kiocb *iocb, struct iov_iter *to)
+{
+	struct example_device *dev = ctx->dev;
+	struct scatterlist sg[2];
+	unsigned int nents, i;
+	size_t copied = 0, n;
+	int ret;
+
+	ret = example_lock(&dev->read_lock, iocb);
+	if (ret)
+		return ret;
+
+	while (kfifo_is_empty(&dev->fifo)) {
+		mutex_unlock(&dev->read_lock);
+		if (example_nowait(iocb))
+			return -EAGAIN;
+		if (wait_event_interruptible(dev->readq, !kfifo_is_empty(&dev->fifo)))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&dev->read_lock))
+			return -ERESTARTSYS;
 	}
 
-	if (copy_from_user(example_buf + *ppos /*to*/ , buf /*from*/ , count)) {
-		printk(KERN_ERR "ERROR, copy_from_user return -EFAULT \n");
-		return -EFAULT;
-	} else {
-		/* Increase the position in the open file */
-		*ppos += count;
-//		printk(KERN_INFO "OK, copy_from_user return %d \n", count);
-		return count;
+	nents = kfifo_dma_out_prepare(&dev->fifo, sg, ARRAY_SIZE(sg), min_t(size_t, iov_iter_count(to), UINT_MAX));
+	for (i = 0; i < nents; i++) {
+		n = example_copy_to_iter(ctx, sg_virt(&sg[i]), sg[i].length, to);
+		copied += n;
+		if (n < sg[i].length)
+			break;
 	}
+	/* unlike kfifo_out(), the dma helpers have no barrier: data must be consumed before the space is released */
+	smp_wmb();
+	kfifo_dma_out_finish(&dev->fifo, copied);
+	mutex_unlock(&dev->read_lock);
+
+	if (!copied)
+		return -EFAULT;
+	wake_up_interruptible(&dev->writeq);
+	return copied;
 }
 
 
 /**************************************************************
- * static int example_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigned long arg)
+ * static ssize_t example_fifo_write(struct example_file *ctx, struct kiocb *iocb, struct iov_iter *from)
  * 
+ * Blocks while FIFO is full, unless example_nowait(). Short write when there is less room than count.
  * ***********************************************************/
-static long example_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+static ssize_t example_fifo_write(struct example_file *ctx, struct kiocb *iocb, struct iov_iter *from)
 {
-	int retval = 0;
-	int i;
+	struct example_device *dev = ctx->dev;
+	struct scatterlist sg[2];
+	unsigned int nents, i;
+	size_t copied = 0, n;
+	int ret;
 
-	printk(KERN_INFO "ENTER example_ioctl, cmd = %d, arg = %lu\n", cmd, arg);
+	ret = example_lock(&dev->write_lock, iocb);
+	if (ret)
+		return ret;
 
-	switch (cmd)
-	{
-		case EXAMPLE_IOCTL_UPPER:
-			printk(KERN_INFO "TO UPPER\n");
-			i = 0;
-			while (example_buf[i]) {
-				example_buf[i] = toupper(example_buf[i]);
-				i++;
-			}
-			break;
+	while (kfifo_is_full(&dev->fifo)) {
+		mutex_unlock(&dev->write_lock);
+		if (example_nowait(iocb))
+			return -EAGAIN;
+		if (wait_event_interruptible(dev->writeq, !kfifo_is_full(&dev->fifo)))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&dev->write_lock))
+			return -ERESTARTSYS;
+	}
 
-		case EXAMPLE_IOCTL_LOWER:
-			printk(KERN_INFO "to lower\n");
-			i = 0;
-			while (example_buf[i]) {
-				example_buf[i] = tolower(example_buf[i]);
-				i++;
-			}
+	nents = kfifo_dma_in_prepare(&dev->fifo, sg, ARRAY_SIZE(sg), min_t(size_t, iov_iter_count(from), UINT_MAX));
+	for (i = 0; i < nents; i++) {
+		n = example_copy_from_iter(ctx, sg_virt(&sg[i]), sg[i].length, from);
+		copied += n;
+		if (n < sg[i].length)
 			break;
-/*
-		case 3:
-			printk("Video ram zajebancija\n");
-			for (i=0; i<video_ram_bufsize; i++) {
-				*((char *)video_ram_buf+i)=i;
-			}
-			break;		
-*/			
-		default:
-			printk(KERN_INFO "not supported command!\n");
 	}
+	/* data must be visible to the reader before it sees the new fill level */
+	smp_wmb();
+	kfifo_dma_in_finish(&dev->fifo, copied);
+	mutex_unlock(&dev->write_lock);
 
-	return retval;
+	if (!copied)
+		return -EFAULT;
+	wake_up_interruptible(&dev->readq);
+	return copied;
 }
 
 
 /**************************************************************
- * static int __exit example_exit(void)
+ * Log mode
  * 
+ * A record is reserved in the ring of the current CPU, filled and published by a release store of head, all with
+ * preemption disabled, so concurrent writers on different CPUs never touch a shared lock or cache line.
+ * User data is copied with page faults disabled, after the pages were faulted in; if one was reclaimed meanwhile
+ * the copy comes up short, the reservation is abandoned and the write retried.
+ * 
+ * Each ring is in timestamp order. The reader merges them, emitting only records older than a bound
+ * (example_log_bound) before which every record is already visible, so the merged stream stays ordered
+ * even while other CPUs are in the middle of an append.
  * ***********************************************************/
-static void __exit example_exit(void)
+#define EXAMPLE_LOG_SKIP	0xff	/* header type: the rest of the ring up to its end is unused */
+#define EXAMPLE_LOG_CLAIM	1		/* pending_ts while the timestamp of a record is being taken */
+#define EXAMPLE_LOG_RETRIES	4
+
+/* Largest payload: a record must fit several times into a ring, and its length into the header */
+static size_t example_log_max_len(struct example_device *dev)
 {
-	struct timeval unload_time;
-	
-	do_gettimeofday(&unload_time);
-	printk(KERN_INFO "%lu seconds have elapsed since loading module\n", unload_time.tv_sec - load_time.tv_sec);
-	
-	/* remove a char device from the system */
-	cdev_del(&example_cdev);
-	
-	unregister_chrdev_region(example_dev, NUM_OF_DEVICES);
-	
-	remove_proc_entry("char_example", NULL);
+	return min_t(size_t, U16_MAX, dev->log_size / 4 - sizeof(struct example_log_hdr));
+}
+
+/* Reserves need contiguous bytes at *head, skipping the end of the ring if they do not fit there.
+ * Returns offset of the space, or -1 (and *head unchanged) if the ring is full. */
+static int example_log_reserve(struct example_device *dev, struct example_log_cpu *c, unsigned int *head,
+							   unsigned int tail, unsigned int need)
+{
+	unsigned int off = *head & (dev->log_size - 1);
+	unsigned int skip = dev->log_size - off < need ? dev->log_size - off : 0;
+
+	if (*head - tail + skip + need > dev->log_size)
+		return -1;
+	if (skip) {
+		/* a gap shorter than a header is recognized by the reader from its offset */
+		if (skip >= sizeof(struct example_log_hdr))
+			((struct example_log_hdr *)(c->data + off))->type = EXAMPLE_LOG_SKIP;
+		*head += skip;
+		off = 0;
+	}
+	*head += need;
+	return off;
+}
+
+static void example_log_fill(struct example_log_hdr *h, u64 ts, unsigned int type, size_t len)
+{
+	h->timestamp = ts;
+	h->pid = task_tgid_nr(current);
+	h->len = len;
+	h->cpu = smp_processor_id();
+	h->type = type;
+}
+
+/* Called with preemption disabled. Returns len, 0 if the user copy faulted, or -ENOBUFS if the ring is full */
+static ssize_t example_log_append(struct example_device *dev, struct example_log_cpu *c, struct iov_iter *from,
+								  size_t len)
+{
+	unsigned int head = c->head, tail = smp_load_acquire(&c->tail);
+	unsigned int need = EXAMPLE_LOG_RECORD_SIZE(len);
+	struct example_log_hdr *h;
+	struct iov_iter saved;
+	size_t copied;
+	u64 ts;
+	int off;
+
+	WRITE_ONCE(c->pending_ts, EXAMPLE_LOG_CLAIM);
+	/* the claim is visible before the timestamp is taken, pairs with example_log_bound() */
+	smp_mb();
+	ts = ktime_get_ns();
+	WRITE_ONCE(c->pending_ts, ts);
+
+	/* report earlier drops first, in the same ring, so the reader sees where records are missing */
+	if (c->lost) {
+		off = example_log_reserve(dev, c, &head, tail, EXAMPLE_LOG_RECORD_SIZE(sizeof(u64)));
+		if (off < 0)
+			goto full;
+		h = (struct example_log_hdr *)(c->data + off);
+		example_log_fill(h, ts, EXAMPLE_LOG_DROPS, sizeof(u64));
+		*(u64 *)(h + 1) = c->lost;
+	}
+
+	off = example_log_reserve(dev, c, &head, tail, need);
+	if (off < 0) {
+		if (c->lost) {
+			/* at least the drop record fits */
+			c->lost = 0;
+			smp_store_release(&c->head, head);
+		}
+		goto full;
+	}
+
+	h = (struct example_log_hdr *)(c->data + off);
+	/* iov_iter_revert() is 4.11+, a copy of the iterator rewinds it on any kernel */
+	saved = *from;
+	pagefault_disable();
+	copied = copy_from_iter(h + 1, len, from);
+	pagefault_enable();
+	if (copied < len) {
+		*from = saved;
+		WRITE_ONCE(c->pending_ts, 0);
+		return 0;
+	}
+	/* padding is read by userspace too, it must not show older records */
+	memset((char *)(h + 1) + len, 0, need - sizeof(*h) - len);
+	example_log_fill(h, ts, EXAMPLE_LOG_DATA, len);
+
+	u64_stats_update_begin(&c->syncp);
+	c->records++;
+	u64_stats_update_end(&c->syncp);
+	c->lost = 0;
+	smp_store_release(&c->head, head);
+	WRITE_ONCE(c->pending_ts, 0);
+	return len;
+
+full:
+	u64_stats_update_begin(&c->syncp);
+	c->dropped++;
+	u64_stats_update_end(&c->syncp);
+	c->lost++;
+	WRITE_ONCE(c->pending_ts, 0);
+	return -ENOBUFS;
 }
 
 
 /**************************************************************
- * static int example_proc_show(struct seq_file *m, void *v)
+ * static ssize_t example_log_write(struct example_device *dev, struct iov_iter *from)
  * 
+ * Whole iterator becomes one record. Never waits for the reader: with a full ring the record is dropped
+ * and -ENOBUFS returned.
  * ***********************************************************/
-static int example_proc_show(struct seq_file *m, void *v)
+static ssize_t example_log_write(struct example_device *dev, struct iov_iter *from)
 {
-	struct timeval cur_time;
+	size_t len = iov_iter_count(from);
+	ssize_t ret = 0;
+	int tries;
+
+	if (len > example_log_max_len(dev))
+		return -EMSGSIZE;
+
+	for (tries = 0; tries < EXAMPLE_LOG_RETRIES && !ret; tries++) {
+		if (iov_iter_fault_in_readable(from, len))
+			return -EFAULT;
+		ret = example_log_append(dev, get_cpu_ptr(dev->log), from, len);
+		put_cpu_ptr(dev->log);
+	}
+	if (!ret)
+		return -EFAULT;
+
+	/* wq_has_sleeper() orders the head store against the reader's check, and skips the wait queue lock
+	 * while nobody sleeps */
+	if (ret > 0 && wq_has_sleeper(&dev->readq))
+		wake_up_interruptible(&dev->readq);
+	return ret;
+}
+
+
+static bool example_log_empty(struct example_device *dev)
+{
+	struct example_log_cpu *c;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		c = per_cpu_ptr(dev->log, cpu);
+		if (READ_ONCE(c->head) != READ_ONCE(c->tail))
+			return false;
+	}
+	return true;
+}
+
+/* Oldest unread record of a ring, NULL if there is none. Called with read_lock held. */
+static struct example_log_hdr *example_log_peek(struct example_device *dev, struct example_log_cpu *c)
+{
+	unsigned int head = smp_load_acquire(&c->head), off;
+	struct example_log_hdr *h;
+
+	while (c->tail != head) {
+		off = c->tail & (dev->log_size - 1);
+		h = (struct example_log_hdr *)(c->data + off);
+		if (dev->log_size - off >= sizeof(*h) && h->type != EXAMPLE_LOG_SKIP)
+			return h;
+		smp_store_release(&c->tail, c->tail + dev->log_size - off);
+	}
+	return NULL;
+}
+
+/* Records older than the returned time are all published. The time is taken before pending_ts of the CPUs
+ * is looked at, so an append not claimed yet gets a later timestamp. A torn 64-bit read of pending_ts on
+ * 32-bit CPUs can only give a smaller value, which makes the bound earlier, never later. */
+static u64 example_log_bound(struct example_device *dev)
+{
+	u64 bound = ktime_get_ns(), p;
+	int cpu;
+
+	smp_mb();
+	for_each_possible_cpu(cpu) {
+		p = READ_ONCE(per_cpu_ptr(dev->log, cpu)->pending_ts);
+		if (p && p < bound)
+			bound = p;
+	}
+	/* heads are read after pending_ts */
+	smp_rmb();
+	return bound;
+}
+
+/* Copies records older than bound to the iterator, oldest first, only whole records */
+static ssize_t example_log_merge(struct example_device *dev, struct iov_iter *to, u64 bound)
+{
+	struct example_log_cpu *c, *best;
+	struct example_log_hdr *h, *best_h = NULL;
+	struct iov_iter saved;
+	size_t copied = 0, rec, n;
+	int cpu;
+
+	for (;;) {
+		best = NULL;
+		for_each_possible_cpu(cpu) {
+			c = per_cpu_ptr(dev->log, cpu);
+			h = example_log_peek(dev, c);
+			if (h && h->timestamp < bound && (!best || h->timestamp < best_h->timestamp)) {
+				best = c;
+				best_h = h;
+			}
+		}
+		if (!best)
+			break;
+
+		rec = EXAMPLE_LOG_RECORD_SIZE(best_h->len);
+		if (rec > iov_iter_count(to))
+			return copied ? copied : -EINVAL;
+		saved = *to;
+		n = copy_to_iter(best_h, rec, to);
+		if (n < rec) {
+			*to = saved;
+			return copied ? copied : -EFAULT;
+		}
+		/* record is consumed before its space is released to the producer */
+		smp_store_release(&best->tail, best->tail + rec);
+		copied += rec;
+	}
+	return copied;
+}
+
+
+/**************************************************************
+ * static ssize_t example_log_read(struct example_device *dev, struct kiocb *iocb, struct iov_iter *to)
+ * 
+ * Blocks while all rings are empty, unless example_nowait(). Returns whole records only,
+ * -EINVAL if the next one does not fit into the request.
+ * ***********************************************************/
+static ssize_t example_log_read(struct example_device *dev, struct kiocb *iocb, struct iov_iter *to)
+{
+	ssize_t ret;
+
+	ret = example_lock(&dev->read_lock, iocb);
+	if (ret)
+		return ret;
+
+	for (;;) {
+		while (example_log_empty(dev)) {
+			mutex_unlock(&dev->read_lock);
+			if (example_nowait(iocb))
+				return -EAGAIN;
+			if (wait_event_interruptible(dev->readq, !example_log_empty(dev)))
+				return -ERESTARTSYS;
+			if (mutex_lock_interruptible(&dev->read_lock))
+				return -ERESTARTSYS;
+		}
+		ret = example_log_merge(dev, to, example_log_bound(dev));
+		if (ret)
+			break;
+		/* records are newer than the bound or still being appended; appends run with preemption disabled
+		 * and finish shortly */
+		cpu_relax();
+	}
+
+	mutex_unlock(&dev->read_lock);
+	return ret;
+}
+
+
+/* Totals of all CPUs, the rings are not locked so queued is approximate */
+static void example_log_sum(struct example_device *dev, struct example_log_stats *st)
+{
+	struct example_log_cpu *c;
+	unsigned int start;
+	u64 records, dropped;
+	int cpu;
+
+	memset(st, 0, sizeof(*st));
+	st->size = dev->log_size;
+	for_each_possible_cpu(cpu) {
+		c = per_cpu_ptr(dev->log, cpu);
+		do {
+			start = u64_stats_fetch_begin(&c->syncp);
+			records = c->records;
+			dropped = c->dropped;
+		} while (u64_stats_fetch_retry(&c->syncp, start));
+		st->records += records;
+		st->dropped += dropped;
+		st->queued += READ_ONCE(c->head) - READ_ONCE(c->tail);
+	}
+}
+
+
+/**************************************************************
+ * Publish mode
+ * 
+ * Readers look up the current version inside an SRCU read side section and copy from it; copy_to_iter()
+ * may fault and sleep, which plain RCU would not allow. srcu_read_lock() only increments a per-CPU counter,
+ * so readers on different CPUs share no cache line and never wait, not even for a writer.
+ * A writer copies the current version, changes the copy and publishes it with rcu_assign_pointer():
+ * readers see either the old or the new version, never a mix.
+ * ***********************************************************/
+
+/* Private copy of the current version for a writer, called with write_lock held */
+static struct example_snapshot *example_snap_dup(struct example_device *dev)
+{
+	struct example_snapshot *old, *s;
+
+	old = rcu_dereference_protected(dev->snap, lockdep_is_held(&dev->write_lock));
+	s = example_snap_alloc(old->len);
+	if (!s)
+		return NULL;
+	s->generation = old->generation + 1;
+	memcpy(s->data, old->data, old->len);
+	return s;
+}
+
+/* Replaces the current version by s, called with write_lock held */
+static void example_snap_publish(struct example_device *dev, struct example_snapshot *s)
+{
+	struct example_snapshot *old;
+
+	old = rcu_dereference_protected(dev->snap, lockdep_is_held(&dev->write_lock));
+	rcu_assign_pointer(dev->snap, s);
+	/* readers may still copy from old, it is freed once they are all gone; the writer does not wait */
+	call_srcu(&dev->srcu, &old->rcu, example_snap_free_rcu);
+}
+
+
+/**************************************************************
+ * static ssize_t example_pub_read(struct example_device *dev, struct kiocb *iocb, struct iov_iter *to)
+ * 
+ * Copies from one version; a later read() may see a newer one, EXAMPLE_IOCTL_GET_GEN tells
+ * ***********************************************************/
+static ssize_t example_pub_read(struct example_device *dev, struct kiocb *iocb, struct iov_iter *to)
+{
+	struct example_snapshot *s;
+	ssize_t ret = 0;
+	size_t copied;
+	int idx;
+
+	idx = srcu_read_lock(&dev->srcu);
+	s = srcu_dereference(dev->snap, &dev->srcu);
+	/* at the end returning 0 (End Of File) */
+	if (iocb->ki_pos < s->len) {
+		copied = copy_to_iter(s->data + iocb->ki_pos, min_t(size_t, s->len - iocb->ki_pos, iov_iter_count(to)), to);
+		ret = copied ? copied : -EFAULT;
+	}
+	srcu_read_unlock(&dev->srcu, idx);
+
+	if (ret > 0)
+		iocb->ki_pos += ret;
+	return ret;
+}
+
+
+/**************************************************************
+ * static ssize_t example_pub_write(struct example_device *dev, struct kiocb *iocb, struct iov_iter *from)
+ * 
+ * One write() (all segments of a writev()) is one new version. Nothing is published unless all data
+ * was copied. A new version is a vmalloc() and a copy of the whole buffer, both may sleep in reclaim,
+ * so IOCB_NOWAIT writes are refused with -EAGAIN and retried by the caller from a context that may block.
+ * ***********************************************************/
+static ssize_t example_pub_write(struct example_device *dev, struct kiocb *iocb, struct iov_iter *from)
+{
+	struct example_snapshot *s;
+	size_t count = iov_iter_count(from);
+	int ret;
+
+	/* size of a version never changes */
+	if (iocb->ki_pos > dev->bufsize || count > dev->bufsize - iocb->ki_pos)
+		return -EIO;
+	if (example_iocb_nowait(iocb))
+		return -EAGAIN;
+
+	ret = example_lock(&dev->write_lock, iocb);
+	if (ret)
+		return ret;
+
+	s = example_snap_dup(dev);
+	if (!s) {
+		mutex_unlock(&dev->write_lock);
+		return -ENOMEM;
+	}
+	if (copy_from_iter(s->data + iocb->ki_pos, count, from) != count) {
+		mutex_unlock(&dev->write_lock);
+		vfree(s);
+		return -EFAULT;
+	}
+	example_snap_publish(dev, s);
+	mutex_unlock(&dev->write_lock);
+
+	iocb->ki_pos += count;
+	return count;
+}
+
+
+static long example_pub_generation(struct example_device *dev, unsigned long arg)
+{
+	unsigned long long gen;
+	int idx;
+
+	if (example_mode != EXAMPLE_MODE_PUBLISH)
+		return -EINVAL;
+
+	idx = srcu_read_lock(&dev->srcu);
+	gen = srcu_dereference(dev->snap, &dev->srcu)->generation;
+	srcu_read_unlock(&dev->srcu, idx);
+
+	return put_user(gen, (unsigned long long __user *)arg);
+}
+
+
+/**************************************************************
+ * static unsigned int example_poll(struct file *file, poll_table *wait)
+ * 
+ * ***********************************************************/
+static unsigned int example_poll(struct file *file, poll_table *wait)
+{
+	struct example_device *dev = example_file_dev(file);
+	unsigned int mask = 0;
+
+	/* buffer and publish modes never block */
+	if (example_mode == EXAMPLE_MODE_BUFFER || example_mode == EXAMPLE_MODE_PUBLISH)
+		return POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM;
+
+	/* log writers never block either, they drop records */
+	if (example_mode == EXAMPLE_MODE_LOG) {
+		poll_wait(file, &dev->readq, wait);
+		mask = POLLOUT | POLLWRNORM;
+		if (!example_log_empty(dev))
+			mask |= POLLIN | POLLRDNORM;
+		return mask;
+	}
+
+	poll_wait(file, &dev->readq, wait);
+	poll_wait(file, &dev->writeq, wait);
+	if (!kfifo_is_empty(&dev->fifo))
+		mask |= POLLIN | POLLRDNORM;
+	if (!kfifo_is_full(&dev->fifo))
+		mask |= POLLOUT | POLLWRNORM;
+
+	return mask;
+}
+
+
+/**************************************************************
+ * static void example_account(struct example_device *dev, enum example_op op, long ret, u64 ns)
+ * 
+ * Adds one call, which took ns, to the statistics of the current CPU
+ * ***********************************************************/
+static void example_account(struct example_device *dev, enum example_op op, long ret, u64 ns)
+{
+	struct example_cpu_stats *stats;
+	struct example_op_stats *s;
+
+	stats = get_cpu_ptr(dev->stats);
+	s = &stats->op[op];
+	u64_stats_update_begin(&stats->syncp);
+	s->calls++;
+	if (ret > 0 && op != EXAMPLE_OP_IOCTL)
+		s->bytes += ret;
+	else if (ret == -EFAULT)
+		s->efault++;
+	else if (ret == -EIO)
+		s->eio++;
+	s->lat_hist[min_t(int, fls64(ns), EXAMPLE_LAT_HIST_SIZE - 1)]++;
+	u64_stats_update_end(&stats->syncp);
+	put_cpu_ptr(dev->stats);
+}
+
+
+/**************************************************************
+ * static ssize_t example_read_iter(struct kiocb *iocb, struct iov_iter *to)
+ * 
+ * Serves read(), readv()/preadv2(), io_uring and splice() from the device (splice_read fills pipe pages
+ * through the same iterator). The whole iov_iter is handled in one call, not one segment at a time.
+ * ***********************************************************/
+static ssize_t example_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{	
+	struct example_file *ctx = iocb->ki_filp->private_data;
+	struct example_device *dev = ctx->dev;
+	u64 start_ns = ktime_get_ns(), ns;
+	loff_t pos = iocb->ki_pos;
+	size_t len = iov_iter_count(to);
+	ssize_t ret;
+
+	if (!len)
+		return 0;
+
+	if (example_mode == EXAMPLE_MODE_FIFO)
+		ret = example_fifo_read(ctx, iocb, to);
+	else if (example_mode == EXAMPLE_MODE_LOG)
+		ret = example_log_read(dev, iocb, to);
+	else if (example_mode == EXAMPLE_MODE_PUBLISH)
+		ret = example_pub_read(dev, iocb, to);
+	else
+		ret = example_buf_read(ctx, iocb, to);
+
+	ns = ktime_get_ns() - start_ns;
+	trace_example_rw(dev->minor, false, pos, len, ret, ns);
+	example_account(dev, EXAMPLE_OP_READ, ret, ns);
+	return ret;
+}
+
+
+/**************************************************************
+ * static ssize_t example_write_iter(struct kiocb *iocb, struct iov_iter *from)
+ * 
+ * Serves write(), writev()/pwritev2(), io_uring and splice() into the device (iter_file_splice_write
+ * passes pipe pages as a bvec iterator)
+ * ***********************************************************/
+static ssize_t example_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{	
+	struct example_file *ctx = iocb->ki_filp->private_data;
+	struct example_device *dev = ctx->dev;
+	u64 start_ns = ktime_get_ns(), ns;
+	loff_t pos = iocb->ki_pos;
+	size_t len = iov_iter_count(from);
+	ssize_t ret;
+
+	if (!len)
+		return 0;
+
+	if (example_mode == EXAMPLE_MODE_FIFO)
+		ret = example_fifo_write(ctx, iocb, from);
+	else if (example_mode == EXAMPLE_MODE_LOG)
+		ret = example_log_write(dev, from);
+	else if (example_mode == EXAMPLE_MODE_PUBLISH)
+		ret = example_pub_write(dev, iocb, from);
+	else
+		ret = example_buf_write(ctx, iocb, from);
+
+	ns = ktime_get_ns() - start_ns;
+	trace_example_rw(dev->minor, true, pos, len, ret, ns);
+	example_account(dev, EXAMPLE_OP_WRITE, ret, ns);
+	return ret;
+}
+
+
+/**************************************************************
+ * static ssize_t example_buf_read(struct example_file *ctx, struct kiocb *iocb, struct iov_iter *to)
+ * 
+ * ***********************************************************/
+static ssize_t example_buf_read(struct example_file *ctx, struct kiocb *iocb, struct iov_iter *to)
+{	
+	struct example_device *dev = ctx->dev;
+	size_t remaining_size, transfer_size, copied;
+	int ret;
+	
+	if (iocb->ki_pos >= dev->bufsize)
+		/* All read, returning 0 (End Of File) */
+		return 0;
+	remaining_size = dev->bufsize - iocb->ki_pos;
+	
+	/* Size of this transfer */
+	transfer_size = min(remaining_size, iov_iter_count(to));
+
+	ret = example_lock(&dev->lock, iocb);
+	if (ret)
+		return ret;
+	copied = example_copy_to_iter(ctx, dev->buf + iocb->ki_pos /* from */ , transfer_size, to);
+	mutex_unlock(&dev->lock);
+
+	if (!copied)
+		return -EFAULT;
+	/* Increase the position in the open file */
+	iocb->ki_pos += copied;
+	return copied;
+}
+
+
+/**************************************************************
+ * static ssize_t example_buf_write(struct example_file *ctx, struct kiocb *iocb, struct iov_iter *from)
+ * 
+ * ***********************************************************/
+static ssize_t example_buf_write(struct example_file *ctx, struct kiocb *iocb, struct iov_iter *from)
+{	
+	struct example_device *dev = ctx->dev;
+	size_t count = iov_iter_count(from), copied;
+	int ret;
+	
+	/* Number of bytes not written yet in the device */
+	if (iocb->ki_pos > dev->bufsize || count > dev->bufsize - iocb->ki_pos) {
+		/* Can't write beyond the end of the device */
+		return -EIO;
+	}
+
+	ret = example_lock(&dev->lock, iocb);
+	if (ret)
+		return ret;
+	copied = example_copy_from_iter(ctx, dev->buf + iocb->ki_pos /*to*/ , count, from);
+	mutex_unlock(&dev->lock);
+
+	if (!copied)
+		return -EFAULT;
+	/* Increase the position in the open file */
+	iocb->ki_pos += copied;
+	return copied;
+}
+
+
+/**************************************************************
+ * static int example_mmap(struct file *file, struct vm_area_struct *vma)
+ * 
+ * Maps buffer of the opened instance (buffer mode only), vm_pgoff selects the starting page
+ * ***********************************************************/
+static int example_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct example_device *dev = example_file_dev(file);
+
+	if (example_mode != EXAMPLE_MODE_BUFFER)
+		return -ENODEV;
+
+	/* remap_vmalloc_range checks that the mapping fits into the buffer */
+	return remap_vmalloc_range(vma, dev->buf, vma->vm_pgoff);
+}
+
+
+/**************************************************************
+ * Cache maintenance between the kernel (vmalloc) view of device buffer and userspace mappings of it.
+ * On CPUs with aliasing caches, data written through the mapping may not yet be visible at the
+ * kernel address, and the other way around. Both are no-ops where caches do not alias.
+ * ***********************************************************/
+static bool example_range_valid(struct example_device *dev, const struct example_range *range)
+{
+	return range->offset <= dev->bufsize && range->length <= dev->bufsize - range->offset;
+}
+
+static void example_sync_from_user(struct example_device *dev, unsigned int offset, unsigned int length)
+{
+	if (length)
+		invalidate_kernel_vmap_range(dev->buf + offset, length);
+}
+
+static void example_sync_to_user(struct example_device *dev, unsigned int offset, unsigned int length)
+{
+	if (length)
+		flush_kernel_vmap_range(dev->buf + offset, length);
+}
+
+
+/**************************************************************
+ * SWAR (SIMD within a register) case conversion
+ * 
+ * Eight bytes are tested in one u64. For every byte, bit 7 of (b & 0x7f) + (0x80 - lo) is set when b >= lo,
+ * and bit 7 of (b & 0x7f) + (0x80 - hi - 1) when b > hi; the sums never carry into the next byte.
+ * Bytes with bit 7 set (non-ASCII) are excluded. Shifting the resulting 0x80 flags right by 2 gives 0x20,
+ * the bit that differs between ASCII upper and lower case letters.
+ * ***********************************************************/
+#define SWAR_ONES	0x0101010101010101ULL
+#define SWAR_HIGH	0x8080808080808080ULL
+
+static inline u64 swar_in_range(u64 w, unsigned char lo, unsigned char hi)
+{
+	u64 t = w & ~SWAR_HIGH;
+	u64 ge_lo = t + (0x80 - lo) * SWAR_ONES;
+	u64 gt_hi = t + (0x80 - hi - 1) * SWAR_ONES;
+
+	return ge_lo & ~gt_hi & ~w & SWAR_HIGH;
+}
+
+/* Flip case of bytes in [lo, hi] within buf[0..len), return number of changed bytes */
+static size_t example_case_range(char *buf, size_t len, unsigned char lo, unsigned char hi)
+{
+	size_t changed = 0;
+	u64 *p, flags;
+
+	/* bytes up to the first aligned word */
+	while (len && ((unsigned long)buf & (sizeof(u64) - 1))) {
+		if (*buf >= lo && *buf <= hi) {
+			*buf ^= 0x20;
+			changed++;
+		}
+		buf++;
+		len--;
+	}
+
+	for (p = (u64 *)buf; len >= sizeof(u64); p++, len -= sizeof(u64)) {
+		flags = swar_in_range(*p, lo, hi);
+		if (flags) {
+			*p ^= flags >> 2;
+			changed += hweight64(flags);
+		}
+	}
+
+	/* remaining tail bytes */
+	for (buf = (char *)p; len; buf++, len--) {
+		if (*buf >= lo && *buf <= hi) {
+			*buf ^= 0x20;
+			changed++;
+		}
+	}
+
+	return changed;
+}
+
+
+/**************************************************************
+ * static long example_pub_ioctl(struct example_device *dev, unsigned int cmd, const struct example_range *range)
+ * 
+ * Publish mode case conversion, done on a private copy which then becomes the new version
+ * ***********************************************************/
+static long example_pub_ioctl(struct example_device *dev, unsigned int cmd, const struct example_range *range)
+{
+	struct example_snapshot *s;
+	long retval = 0;
+	int i;
+
+	switch (cmd)
+	{
+		case EXAMPLE_IOCTL_UPPER:
+		case EXAMPLE_IOCTL_LOWER:
+		case EXAMPLE_IOCTL_UPPER_RANGE:
+		case EXAMPLE_IOCTL_LOWER_RANGE:
+			break;
+		case EXAMPLE_IOCTL_SYNC:
+			/* versions are not mapped */
+			return -EINVAL;
+		default:
+			return 0;
+	}
+
+	if (mutex_lock_interruptible(&dev->write_lock))
+		return -ERESTARTSYS;
+	s = example_snap_dup(dev);
+	if (!s) {
+		mutex_unlock(&dev->write_lock);
+		return -ENOMEM;
+	}
+
+	switch (cmd)
+	{
+		case EXAMPLE_IOCTL_UPPER:
+			for (i = 0; i < s->len && s->data[i]; i++)
+				s->data[i] = toupper(s->data[i]);
+			break;
+		case EXAMPLE_IOCTL_LOWER:
+			for (i = 0; i < s->len && s->data[i]; i++)
+				s->data[i] = tolower(s->data[i]);
+			break;
+		case EXAMPLE_IOCTL_UPPER_RANGE:
+			retval = example_case_range(s->data + range->offset, range->length, 'a', 'z');
+			break;
+		case EXAMPLE_IOCTL_LOWER_RANGE:
+			retval = example_case_range(s->data + range->offset, range->length, 'A', 'Z');
+			break;
+	}
+
+	example_snap_publish(dev, s);
+	mutex_unlock(&dev->write_lock);
+	return retval;
+}
+
+
+/**************************************************************
+ * static long example_do_ioctl(struct example_device *dev, unsigned int cmd, unsigned long arg)
+ * 
+ * ***********************************************************/
+static long example_do_ioctl(struct example_device *dev, unsigned int cmd, unsigned long arg)
+{
+	long retval = 0;
+	int i;
+	struct example_range range;
+
+	/* case conversion works on buffer, which is not used in FIFO and log modes */
+	if (example_mode == EXAMPLE_MODE_FIFO || example_mode == EXAMPLE_MODE_LOG)
+		return -EINVAL;
+
+	/* range is read before the buffer is locked, copy_from_user may sleep on a page fault */
+	switch (cmd)
+	{
+		case EXAMPLE_IOCTL_SYNC:
+		case EXAMPLE_IOCTL_UPPER_RANGE:
+		case EXAMPLE_IOCTL_LOWER_RANGE:
+			if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+				return -EFAULT;
+			if (!example_range_valid(dev, &range))
+				return -EINVAL;
+			break;
+	}
+
+	if (example_mode == EXAMPLE_MODE_PUBLISH)
+		return example_pub_ioctl(dev, cmd, &range);
+
+	if (mutex_lock_interruptible(&dev->lock))
+		return -ERESTARTSYS;
+
+	switch (cmd)
+	{
+		case EXAMPLE_IOCTL_UPPER:
+			example_sync_from_user(dev, 0, dev->bufsize);
+			i = 0;
+			while (i < dev->bufsize && dev->buf[i]) {
+				dev->buf[i] = toupper(dev->buf[i]);
+				i++;
+			}
+			example_sync_to_user(dev, 0, i);
+			break;
+
+		case EXAMPLE_IOCTL_LOWER:
+			example_sync_from_user(dev, 0, dev->bufsize);
+			i = 0;
+			while (i < dev->bufsize && dev->buf[i]) {
+				dev->buf[i] = tolower(dev->buf[i]);
+				i++;
+			}
+			example_sync_to_user(dev, 0, i);
+			break;
+
+		case EXAMPLE_IOCTL_SYNC:
+			example_sync_from_user(dev, range.offset, range.length);
+			break;
+
+		case EXAMPLE_IOCTL_UPPER_RANGE:
+		case EXAMPLE_IOCTL_LOWER_RANGE:
+			example_sync_from_user(dev, range.offset, range.length);
+			if (cmd == EXAMPLE_IOCTL_UPPER_RANGE)
+				retval = example_case_range(dev->buf + range.offset, range.length, 'a', 'z');
+			else
+				retval = example_case_range(dev->buf + range.offset, range.length, 'A', 'Z');
+			example_sync_to_user(dev, range.offset, range.length);
+			break;
+/*
+		case 3:
+			printk("Video ram zajebancija\n");
+			for (i=0; i<video_ram_bufsize; i++) {
+				*((char *)video_ram_buf+i)=i;
+			}
+			break;		
+*/			
+		default:
+			/* unknown commands are a no-op, visible in the example_ioctl tracepoint */
+			break;
+	}
+
+	mutex_unlock(&dev->lock);
+	return retval;
+}
+
+
+/**************************************************************
+ * Transform configuration. Changes must not race with read/write of the same file, which use the
+ * transforms under dev->lock (buffer mode) or read_lock/write_lock (FIFO mode), so all of them are taken.
+ * ***********************************************************/
+static int example_lock_io(struct example_device *dev)
+{
+	if (example_mode != EXAMPLE_MODE_FIFO)
+		return mutex_lock_interruptible(&dev->lock) ? -ERESTARTSYS : 0;
+
+	if (mutex_lock_interruptible(&dev->read_lock))
+		return -ERESTARTSYS;
+	if (mutex_lock_interruptible(&dev->write_lock)) {
+		mutex_unlock(&dev->read_lock);
+		return -ERESTARTSYS;
+	}
+	return 0;
+}
+
+static void example_unlock_io(struct example_device *dev)
+{
+	if (example_mode != EXAMPLE_MODE_FIFO) {
+		mutex_unlock(&dev->lock);
+		return;
+	}
+	mutex_unlock(&dev->write_lock);
+	mutex_unlock(&dev->read_lock);
+}
+
+/* Compose case folding, XOR and user table into one lookup table */
+static void example_xform_build(struct example_file *ctx, struct example_xform_state *x)
+{
+	int i;
+	u8 b;
+
+	for (i = 0; i < 256; i++) {
+		b = i;
+		if ((x->flags & EXAMPLE_XFORM_UPPER) && b >= 'a' && b <= 'z')
+			b ^= 0x20;
+		else if ((x->flags & EXAMPLE_XFORM_LOWER) && b >= 'A' && b <= 'Z')
+			b ^= 0x20;
+		if (x->flags & EXAMPLE_XFORM_XOR)
+			b ^= ctx->xor_key;
+		if (x->flags & EXAMPLE_XFORM_MAP)
+			b = ctx->map[b];
+		x->lut[i] = b;
+	}
+}
+
+static void example_xform_csum(const struct example_xform_state *x, struct example_csum *csum)
+{
+	csum->bytes = x->bytes;
+	csum->crc32 = (x->flags & EXAMPLE_XFORM_CRC32) ? ~x->crc : 0;
+#ifdef EXAMPLE_HAVE_XXH64
+	csum->xxh64 = (x->flags & EXAMPLE_XFORM_XXH64) ? xxh64_digest(&x->xxh) : 0;
+#else
+	csum->xxh64 = 0;
+#endif
+	csum->flags = x->flags;
+}
+
+static int example_xform_check(unsigned int flags)
+{
+	if ((flags & ~EXAMPLE_XFORM_ALL) ||
+		(flags & (EXAMPLE_XFORM_UPPER | EXAMPLE_XFORM_LOWER)) == (EXAMPLE_XFORM_UPPER | EXAMPLE_XFORM_LOWER))
+		return -EINVAL;
+#ifndef EXAMPLE_HAVE_XXH64
+	if (flags & EXAMPLE_XFORM_XXH64)
+		return -EOPNOTSUPP;
+#endif
+	return 0;
+}
+
+
+/**************************************************************
+ * static long example_xform_ioctl(struct example_file *ctx, unsigned int cmd, unsigned long arg)
+ * 
+ * EXAMPLE_IOCTL_SET_XFORM, EXAMPLE_IOCTL_SET_MAP and EXAMPLE_IOCTL_GET_CSUM, in buffer and FIFO modes.
+ * Log mode writers and publish mode readers take no lock the transforms could be changed under.
+ * ***********************************************************/
+static long example_xform_ioctl(struct example_file *ctx, unsigned int cmd, unsigned long arg)
+{
+	struct example_device *dev = ctx->dev;
+	struct example_xform xf;
+	struct example_map map;
+	struct example_csums csums;
+	u8 *bounce = NULL;
+	int ret, dir;
+
+	if (example_mode == EXAMPLE_MODE_LOG || example_mode == EXAMPLE_MODE_PUBLISH)
+		return -EINVAL;
+
+	/* user memory is accessed and the bounce page allocated outside of the locks, both may sleep */
+	switch (cmd)
+	{
+		case EXAMPLE_IOCTL_SET_XFORM:
+			if (copy_from_user(&xf, (void __user *)arg, sizeof(xf)))
+				return -EFAULT;
+			ret = example_xform_check(xf.write_flags);
+			if (!ret)
+				ret = example_xform_check(xf.read_flags);
+			if (ret)
+				return ret;
+			if ((xf.read_flags & EXAMPLE_XFORM_BYTEMAP) && !ctx->bounce) {
+				bounce = kmalloc(PAGE_SIZE, GFP_KERNEL);
+				if (!bounce)
+					return -ENOMEM;
+			}
+			break;
+
+		case EXAMPLE_IOCTL_SET_MAP:
+			if (copy_from_user(&map, (void __user *)arg, sizeof(map)))
+				return -EFAULT;
+			break;
+	}
+
+	ret = example_lock_io(dev);
+	if (ret) {
+		kfree(bounce);
+		return ret;
+	}
+
+	switch (cmd)
+	{
+		case EXAMPLE_IOCTL_SET_XFORM:
+			if (bounce && !ctx->bounce) {
+				ctx->bounce = bounce;
+				bounce = NULL;
+			}
+			ctx->xor_key = xf.xor_key;
+			ctx->xform[EXAMPLE_DIR_WRITE].flags = xf.write_flags;
+			ctx->xform[EXAMPLE_DIR_READ].flags = xf.read_flags;
+			for (dir = 0; dir < EXAMPLE_NUM_DIRS; dir++) {
+				example_xform_build(ctx, &ctx->xform[dir]);
+				ctx->xform[dir].crc = ~0;
+#ifdef EXAMPLE_HAVE_XXH64
+				xxh64_reset(&ctx->xform[dir].xxh, 0);
+#endif
+				ctx->xform[dir].bytes = 0;
+			}
+			break;
+
+		case EXAMPLE_IOCTL_SET_MAP:
+			memcpy(ctx->map, map.table, sizeof(ctx->map));
+			for (dir = 0; dir < EXAMPLE_NUM_DIRS; dir++)
+				example_xform_build(ctx, &ctx->xform[dir]);
+			break;
+
+		case EXAMPLE_IOCTL_GET_CSUM:
+			example_xform_csum(&ctx->xform[EXAMPLE_DIR_WRITE], &csums.write);
+			example_xform_csum(&ctx->xform[EXAMPLE_DIR_READ], &csums.read);
+			break;
+	}
+
+	example_unlock_io(dev);
+	kfree(bounce);
+
+	if (cmd == EXAMPLE_IOCTL_GET_CSUM && copy_to_user((void __user *)arg, &csums, sizeof(csums)))
+		return -EFAULT;
+	return 0;
+}
+
+
+/**************************************************************
+ * static int example_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigned long arg)
+ * 
+ * ***********************************************************/
+static long example_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct example_device *dev = example_file_dev(file);
+	struct example_log_stats st;
+	u64 start_ns = ktime_get_ns(), ns;
+	long ret;
+
+	switch (cmd)
+	{
+		case EXAMPLE_IOCTL_SET_XFORM:
+		case EXAMPLE_IOCTL_SET_MAP:
+		case EXAMPLE_IOCTL_GET_CSUM:
+			ret = example_xform_ioctl(file->private_data, cmd, arg);
+			break;
+		case EXAMPLE_IOCTL_LOG_STATS:
+			ret = 0;
+			if (example_mode != EXAMPLE_MODE_LOG)
+				ret = -EINVAL;
+			else {
+				example_log_sum(dev, &st);
+				if (copy_to_user((void __user *)arg, &st, sizeof(st)))
+					ret = -EFAULT;
+			}
+			break;
+		case EXAMPLE_IOCTL_GET_GEN:
+			ret = example_pub_generation(dev, arg);
+			break;
+		default:
+			ret = example_do_ioctl(dev, cmd, arg);
+			break;
+	}
+	ns = ktime_get_ns() - start_ns;
+	trace_example_ioctl(dev->minor, cmd, ret, ns);
+	example_account(dev, EXAMPLE_OP_IOCTL, ret, ns);
+	return ret;
+}
+
+
+/**************************************************************
+ * static int __exit example_exit(void)
+ * 
+ * ***********************************************************/
+static void __exit example_exit(void)
+{
+	struct timeval unload_time;
+	int i;
+	
+	do_gettimeofday(&unload_time);
+	printk(KERN_INFO "%lu seconds have elapsed since loading module\n", unload_time.tv_sec - load_time.tv_sec);
+	
+	remove_proc_entry("char_example", NULL);
+
+	/* remove char devices from the system */
+	for (i = 0; i < example_num_devices; i++)
+		cdev_del(&example_devices[i].cdev);
+	
+	unregister_chrdev_region(example_dev, example_num_devices);
+
+	for (i = 0; i < example_num_devices; i++)
+		example_device_free(&example_devices[i]);
+	kfree(example_devices);
+}
+
+
+/**************************************************************
+ * static void example_stats_sum(struct example_device *dev, enum example_op op, struct example_op_stats *sum)
+ * 
+ * Adds up per-CPU counters of one operation, called with example_stats_lock held
+ * ***********************************************************/
+static void example_stats_sum(struct example_device *dev, enum example_op op, struct example_op_stats *sum)
+{
+	struct example_cpu_stats *stats;
+	struct example_op_stats s;
+	unsigned int start;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(dev->stats, cpu);
+		do {
+			start = u64_stats_fetch_begin(&stats->syncp);
+			s = stats->op[op];
+		} while (u64_stats_fetch_retry(&stats->syncp, start));
+
+		sum->calls += s.calls;
+		sum->bytes += s.bytes;
+		sum->efault += s.efault;
+		sum->eio += s.eio;
+		for (i = 0; i < EXAMPLE_LAT_HIST_SIZE; i++)
+			sum->lat_hist[i] += s.lat_hist[i];
+	}
+}
+
+
+/**************************************************************
+ * static int example_proc_show(struct seq_file *m, void *v)
+ * 
+ * First line is time elapsed since loading module, then statistics of every minor:
+ * 	minor 0 read: calls 12 bytes 1200 efault 0 eio 0
+ * 	  latency ns: <2048 10 <4096 2
+ * where "<2048 10" means 10 calls took [1024, 2048) ns. In log mode also
+ * 	minor 0 log: records 100 dropped 0 queued 1600 size 65536
+ * (not reset by writing to the file)
+ * ***********************************************************/
+static int example_proc_show(struct seq_file *m, void *v)
+{
+	struct timeval cur_time;
+	struct example_device *dev;
+	struct example_op_stats sum, *base;
+	struct example_log_stats st;
+	int i, op, b;
     
     do_gettimeofday(&cur_time);
     seq_printf(m, "%lu\n", cur_time.tv_sec - load_time.tv_sec);
+
+    mutex_lock(&example_stats_lock);
+    for (i = 0; i < example_num_devices; i++) {
+        dev = &example_devices[i];
+        seq_printf(m, "minor %d: opens %d\n", dev->minor, atomic_read(&dev->opens));
+        if (example_mode == EXAMPLE_MODE_LOG) {
+            example_log_sum(dev, &st);
+            seq_printf(m, "minor %d log: records %llu dropped %llu queued %u size %u\n", dev->minor,
+                       st.records, st.dropped, st.queued, st.size);
+        }
+        for (op = 0; op < EXAMPLE_NUM_OPS; op++) {
+            example_stats_sum(dev, op, &sum);
+            base = &dev->stats_base[op];
+            seq_printf(m, "minor %d %s: calls %llu bytes %llu efault %llu eio %llu\n", dev->minor, example_op_names[op],
+                       sum.calls - base->calls, sum.bytes - base->bytes,
+                       sum.efault - base->efault, sum.eio - base->eio);
+            seq_puts(m, "  latency ns:");
+            for (b = 0; b < EXAMPLE_LAT_HIST_SIZE; b++) {
+                if (sum.lat_hist[b] == base->lat_hist[b])
+                    continue;
+                if (b == EXAMPLE_LAT_HIST_SIZE - 1)
+                    seq_printf(m, " >=%llu %llu", 1ULL << (b - 1), sum.lat_hist[b] - base->lat_hist[b]);
+                else
+                    seq_printf(m, " <%llu %llu", 1ULL << b, sum.lat_hist[b] - base->lat_hist[b]);
+            }
+            seq_putc(m, '\n');
+        }
+    }
+    mutex_unlock(&example_stats_lock);
     return 0;
 }
 
 
+/**************************************************************
+ * static ssize_t example_proc_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+ * 
+ * Any write resets statistics of all minors. Per-CPU counters are never written by another CPU:
+ * current totals become the new base, which is subtracted when statistics are shown.
+ * ***********************************************************/
+static ssize_t example_proc_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	int i, op;
+
+	mutex_lock(&example_stats_lock);
+	for (i = 0; i < example_num_devices; i++)
+		for (op = 0; op < EXAMPLE_NUM_OPS; op++)
+			example_stats_sum(&example_devices[i], op, &example_devices[i].stats_base[op]);
+	mutex_unlock(&example_stats_lock);
+
+	return count;
+}
+
+
 /**************************************************************
  * static int example_proc_open(struct inode *inode, struct file *file)
  * 
@@ -7,8 +7,80 @@ typedef struct {
     int i;
     int j;
 } lkmc_ioctl_struct;
+/* Byte range of the device buffer */
+struct example_range {
+    unsigned int offset;
+    unsigned int length;
+};
+
+/* Transforms applied per open file to data as it streams through read()/write().
+ * Byte mappings run first, in this order: case folding, XOR with xor_key, user table (EXAMPLE_IOCTL_SET_MAP);
+ * they are composed into one 256-entry table, so every byte is looked up once.
+ * Checksums then cover the transformed bytes, i.e. what is stored on write and what is returned on read. */
+#define EXAMPLE_XFORM_UPPER  0x01   /* ASCII letters to upper case */
+#define EXAMPLE_XFORM_LOWER  0x02   /* ASCII letters to lower case */
+#define EXAMPLE_XFORM_XOR    0x04   /* XOR every byte with xor_key */
+#define EXAMPLE_XFORM_MAP    0x08   /* map every byte through the user table */
+#define EXAMPLE_XFORM_CRC32  0x10   /* running CRC-32 (as zlib crc32()) */
+#define EXAMPLE_XFORM_XXH64  0x20   /* running XXH64, seed 0; -EOPNOTSUPP if the kernel has no lib/xxhash */
+
+struct example_xform {
+    unsigned int write_flags;   /* EXAMPLE_XFORM_* applied to written data */
+    unsigned int read_flags;    /* EXAMPLE_XFORM_* applied to read data */
+    unsigned int xor_key;       /* low byte is used */
+};
+
+struct example_map {
+    unsigned char table[256];
+};
+
+/* Checksums of one direction since the last EXAMPLE_IOCTL_SET_XFORM */
+struct example_csum {
+    unsigned long long bytes;
+    unsigned long long xxh64;
+    unsigned int crc32;
+    unsigned int flags;
+};
+
+struct example_csums {
+    struct example_csum write;
+    struct example_csum read;
+};
+
+/* Log mode (insmod example.ko mode=log): every write() is one record. read() returns the records of all writers
+ * merged in timestamp order, each one as this header followed by len payload bytes, padded with zeros to a multiple of 8 */
+struct example_log_hdr {
+    unsigned long long timestamp;   /* CLOCK_MONOTONIC ns, taken when the record was written */
+    unsigned int pid;               /* process (thread group) id of the writer */
+    unsigned short len;             /* payload bytes */
+    unsigned char cpu;              /* CPU the record was written on (low 8 bits) */
+    unsigned char type;             /* EXAMPLE_LOG_* */
+};
+#define EXAMPLE_LOG_DATA    0
+#define EXAMPLE_LOG_DROPS   1       /* payload is unsigned long long: records dropped on this CPU since the previous one */
+#define EXAMPLE_LOG_RECORD_SIZE(len)    (((len) + sizeof(struct example_log_hdr) + 7) & ~7UL)
+
+struct example_log_stats {
+    unsigned long long records;     /* records written */
+    unsigned long long dropped;     /* records dropped because their CPU buffer was full */
+    unsigned int queued;            /* bytes waiting to be read */
+    unsigned int size;              /* buffer bytes per CPU */
+};
+
 #define EXAMPLE_IOCTL_MAGIC 0x33
 #define EXAMPLE_IOCTL_UPPER  _IOW(EXAMPLE_IOCTL_MAGIC, 0, int)
 #define EXAMPLE_IOCTL_LOWER  _IOW(EXAMPLE_IOCTL_MAGIC, 1, lkmc_ioctl_struct)
+/* Publish a range written through mmap() to the driver (and to read()/ioctl) */
+#define EXAMPLE_IOCTL_SYNC   _IOW(EXAMPLE_IOCTL_MAGIC, 2, struct example_range)
+/* Convert ASCII letters in the range, return value is number of changed bytes */
+#define EXAMPLE_IOCTL_UPPER_RANGE  _IOW(EXAMPLE_IOCTL_MAGIC, 3, struct example_range)
+#define EXAMPLE_IOCTL_LOWER_RANGE  _IOW(EXAMPLE_IOCTL_MAGIC, 4, struct example_range)
+/* Select transforms of this open file and reset its checksums */
+#define EXAMPLE_IOCTL_SET_XFORM    _IOW(EXAMPLE_IOCTL_MAGIC, 5, struct example_xform)
+#define EXAMPLE_IOCTL_SET_MAP      _IOW(EXAMPLE_IOCTL_MAGIC, 6, struct example_map)
+#define EXAMPLE_IOCTL_GET_CSUM     _IOR(EXAMPLE_IOCTL_MAGIC, 7, struct example_csums)
+#define EXAMPLE_IOCTL_LOG_STATS    _IOR(EXAMPLE_IOCTL_MAGIC, 8, struct example_log_stats)
+/* Publish mode: generation of the current buffer version, incremented by every write() or case conversion */
+#define EXAMPLE_IOCTL_GET_GEN      _IOR(EXAMPLE_IOCTL_MAGIC, 9, unsigned long long)
 
 #endif
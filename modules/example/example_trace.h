@@ -0,0 +1,71 @@
+/* Tracepoints of the char_example module, in place of printk logging on the I/O path.
+ * They cost a not-taken branch while disabled. Enable and capture with ftrace:
+ * 	echo 1 > /sys/kernel/debug/tracing/events/char_example/enable
+ * 	cat /sys/kernel/debug/tracing/trace_pipe
+ * or with perf: perf record -e 'char_example:*' */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM char_example
+
+#if !defined(_EXAMPLE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _EXAMPLE_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* read_iter/write_iter: file position, requested length, result (bytes or -errno) and duration */
+TRACE_EVENT(example_rw,
+	TP_PROTO(int minor, bool write, loff_t pos, size_t len, long ret, u64 duration_ns),
+	TP_ARGS(minor, write, pos, len, ret, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(bool, write)
+		__field(loff_t, pos)
+		__field(size_t, len)
+		__field(long, ret)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->write = write;
+		__entry->pos = pos;
+		__entry->len = len;
+		__entry->ret = ret;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("minor=%d %s pos=%lld len=%zu ret=%ld duration_ns=%llu",
+		  __entry->minor, __entry->write ? "write" : "read", __entry->pos, __entry->len,
+		  __entry->ret, __entry->duration_ns)
+);
+
+TRACE_EVENT(example_ioctl,
+	TP_PROTO(int minor, unsigned int cmd, long ret, u64 duration_ns),
+	TP_ARGS(minor, cmd, ret, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(unsigned int, cmd)
+		__field(long, ret)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->cmd = cmd;
+		__entry->ret = ret;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("minor=%d cmd=0x%x ret=%ld duration_ns=%llu",
+		  __entry->minor, __entry->cmd, __entry->ret, __entry->duration_ns)
+);
+
+#endif /* _EXAMPLE_TRACE_H */
+
+/* This part must be outside protection, the header is looked up in the module directory (-I$(src) in Makefile) */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE example_trace
+#include <trace/define_trace.h>
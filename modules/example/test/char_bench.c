@@ -0,0 +1,386 @@
+/* Throughput and latency benchmark for the char_example device.
+ * Usage: char_bench [options]
+ *   -d <device>    device file, may be given several times: thread N uses device N % count (default /dev/char_example)
+ *   -t <threads>   number of threads, every one opens its own file (default 1)
+ *   -w <workload>  read, write, ioctl or mixed (default read)
+ *   -m <r:w:i>     mixed workload weights of read, write and ioctl (default 60:30:10)
+ *   -s <bytes>     request size (default 64)
+ *   -o <offset>    file offset of every request (default 0)
+ *   -T <seconds>   run for fixed time (default 5)
+ *   -n <ops>       run for fixed number of operations in total, instead of time
+ *   -a             pin thread N to CPU N % number of CPUs
+ *   -N             open with O_NONBLOCK (FIFO mode), -EAGAIN is counted separately from errors
+ *   -j             print results as JSON instead of text
+ * Example: char_bench -d /dev/char_example -d /dev/char_example1 -t 4 -w mixed -s 4096 -T 10 -a
+ *
+ * read and write use pread()/pwrite() at the given offset, ioctl is EXAMPLE_IOCTL_UPPER_RANGE over {offset, size}.
+ * Latency of every call is recorded in a per-thread log-linear histogram (32 sub-buckets per power of two),
+ * so reported percentiles are lower bounds of their bucket, within 1/32 of the value.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include "../example_ioctl.h"
+
+#define MAX_DEVICES	64
+#define MAX_THREADS	256
+
+enum op {
+	OP_READ,
+	OP_WRITE,
+	OP_IOCTL,
+	NUM_OPS
+};
+static const char * const op_names[NUM_OPS] = { "read", "write", "ioctl" };
+
+/* Values below 32 ns get their own bucket, above that 32 sub-buckets per power of two */
+#define HIST_SUB_BITS	5
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_SIZE	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct op_stats {
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t again;
+	uint64_t max_ns;
+	uint64_t hist[HIST_SIZE];
+};
+
+struct thread {
+	pthread_t tid;
+	int index;
+	const char *device;
+	uint64_t quota;		/* operations to do, 0 when running for fixed time */
+	struct op_stats stats[NUM_OPS];
+};
+
+/* Configuration, set by main() before threads start */
+static const char *devices[MAX_DEVICES];
+static int num_devices;
+static int num_threads = 1;
+static int workload = OP_READ;
+static int mixed;
+static unsigned int weights[NUM_OPS] = { 60, 30, 10 };
+static size_t req_size = 64;
+static off_t req_offset;
+static double duration = 5;
+static uint64_t total_ops;
+static int pin_cpus;
+static int nonblock;
+static int json;
+
+static pthread_barrier_t start_barrier;
+static volatile int stop;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int hist_index(uint64_t v)
+{
+	int e;
+
+	if (v < HIST_SUB)
+		return v;
+	e = 63 - __builtin_clzll(v);
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static uint64_t hist_value(unsigned int idx)
+{
+	int e;
+
+	if (idx < HIST_SUB)
+		return idx;
+	e = idx / HIST_SUB + HIST_SUB_BITS - 1;
+	return (uint64_t)(HIST_SUB + idx % HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+static uint64_t hist_percentile(const struct op_stats *s, double p)
+{
+	uint64_t want, seen = 0;
+	unsigned int i;
+
+	if (s->ops == 0)
+		return 0;
+	want = (uint64_t)(p / 100 * s->ops);
+	if (want >= s->ops)
+		want = s->ops - 1;
+	for (i = 0; i < HIST_SIZE; i++) {
+		seen += s->hist[i];
+		if (seen > want)
+			return hist_value(i);
+	}
+	return s->max_ns;
+}
+
+/* xorshift, so op selection in mixed mode costs no shared state */
+static inline uint32_t next_rand(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static int pick_op(uint32_t *rnd)
+{
+	unsigned int r;
+
+	if (!mixed)
+		return workload;
+	r = next_rand(rnd) % (weights[OP_READ] + weights[OP_WRITE] + weights[OP_IOCTL]);
+	if (r < weights[OP_READ])
+		return OP_READ;
+	if (r < weights[OP_READ] + weights[OP_WRITE])
+		return OP_WRITE;
+	return OP_IOCTL;
+}
+
+static void *thread_fn(void *arg)
+{
+	struct thread *t = arg;
+	struct example_range range = { .offset = req_offset, .length = req_size };
+	struct op_stats *s;
+	uint32_t rnd = 2463534242u + t->index * 7919;
+	uint64_t start, ns, done = 0;
+	cpu_set_t set;
+	ssize_t ret;
+	char *buf;
+	int fd, op;
+
+	if (pin_cpus) {
+		CPU_ZERO(&set);
+		CPU_SET(t->index % sysconf(_SC_NPROCESSORS_ONLN), &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			fprintf(stderr, "thread %d: cannot set CPU affinity\n", t->index);
+	}
+
+	buf = malloc(req_size);
+	fd = open(t->device, O_RDWR | (nonblock ? O_NONBLOCK : 0));
+	if (buf == NULL || fd < 0) {
+		fprintf(stderr, "thread %d: cannot open %s: %s\n", t->index, t->device, strerror(errno));
+		exit(1);
+	}
+	memset(buf, 'a', req_size);
+
+	pthread_barrier_wait(&start_barrier);
+
+	while (!stop && (t->quota == 0 || done < t->quota)) {
+		op = pick_op(&rnd);
+		start = now_ns();
+		switch (op) {
+		case OP_READ:
+			ret = pread(fd, buf, req_size, req_offset);
+			break;
+		case OP_WRITE:
+			ret = pwrite(fd, buf, req_size, req_offset);
+			break;
+		default:
+			ret = ioctl(fd, EXAMPLE_IOCTL_UPPER_RANGE, &range);
+			break;
+		}
+		ns = now_ns() - start;
+
+		s = &t->stats[op];
+		s->ops++;
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				s->again++;
+			else
+				s->errors++;
+		}
+		else if (op != OP_IOCTL) {
+			s->bytes += ret;
+		}
+		if (ns > s->max_ns)
+			s->max_ns = ns;
+		s->hist[hist_index(ns)]++;
+		done++;
+	}
+
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+static void merge(struct op_stats *dst, const struct op_stats *src)
+{
+	unsigned int i;
+
+	dst->ops += src->ops;
+	dst->bytes += src->bytes;
+	dst->errors += src->errors;
+	dst->again += src->again;
+	if (src->max_ns > dst->max_ns)
+		dst->max_ns = src->max_ns;
+	for (i = 0; i < HIST_SIZE; i++)
+		dst->hist[i] += src->hist[i];
+}
+
+static void print_text_row(const char *name, const struct op_stats *s, double elapsed)
+{
+	printf("%-6s %12llu %12.0f %10.2f %9llu %9llu %9llu %10llu %8llu %8llu\n", name,
+	       (unsigned long long)s->ops, s->ops / elapsed, s->bytes / elapsed / 1e6,
+	       (unsigned long long)hist_percentile(s, 50), (unsigned long long)hist_percentile(s, 99),
+	       (unsigned long long)hist_percentile(s, 99.9), (unsigned long long)s->max_ns,
+	       (unsigned long long)s->errors, (unsigned long long)s->again);
+}
+
+static void print_json_row(const char *name, const struct op_stats *s, double elapsed, int last)
+{
+	printf("    \"%s\": {\"ops\": %llu, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f, \"bytes\": %llu, "
+	       "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu, \"errors\": %llu, \"eagain\": %llu}%s\n",
+	       name, (unsigned long long)s->ops, s->ops / elapsed, s->bytes / elapsed / 1e6, (unsigned long long)s->bytes,
+	       (unsigned long long)hist_percentile(s, 50), (unsigned long long)hist_percentile(s, 99),
+	       (unsigned long long)hist_percentile(s, 99.9), (unsigned long long)s->max_ns,
+	       (unsigned long long)s->errors, (unsigned long long)s->again, last ? "" : ",");
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d device]... [-t threads] [-w read|write|ioctl|mixed] [-m r:w:i] [-s size] [-o offset]\n"
+	        "       [-T seconds | -n ops] [-a] [-N] [-j]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct thread threads[MAX_THREADS];
+	static struct op_stats total[NUM_OPS], all;
+	struct timespec ts;
+	uint64_t start, end;
+	double elapsed;
+	int opt, i, op;
+
+	while ((opt = getopt(argc, argv, "d:t:w:m:s:o:T:n:aNj")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (num_devices == MAX_DEVICES)
+				usage(argv[0]);
+			devices[num_devices++] = optarg;
+			break;
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 'w':
+			mixed = 0;
+			if (strcmp(optarg, "mixed") == 0)
+				mixed = 1;
+			else if (strcmp(optarg, "read") == 0)
+				workload = OP_READ;
+			else if (strcmp(optarg, "write") == 0)
+				workload = OP_WRITE;
+			else if (strcmp(optarg, "ioctl") == 0)
+				workload = OP_IOCTL;
+			else
+				usage(argv[0]);
+			break;
+		case 'm':
+			if (sscanf(optarg, "%u:%u:%u", &weights[OP_READ], &weights[OP_WRITE], &weights[OP_IOCTL]) != 3 ||
+			    weights[OP_READ] + weights[OP_WRITE] + weights[OP_IOCTL] == 0)
+				usage(argv[0]);
+			break;
+		case 's':
+			req_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			req_offset = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			duration = atof(optarg);
+			break;
+		case 'n':
+			total_ops = strtoull(optarg, NULL, 0);
+			break;
+		case 'a':
+			pin_cpus = 1;
+			break;
+		case 'N':
+			nonblock = 1;
+			break;
+		case 'j':
+			json = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || num_threads < 1 || num_threads > MAX_THREADS || req_size == 0 ||
+	    (total_ops == 0 && duration <= 0) || (total_ops && total_ops < (uint64_t)num_threads))
+		usage(argv[0]);
+	if (num_devices == 0)
+		devices[num_devices++] = "/dev/char_example";
+
+	pthread_barrier_init(&start_barrier, NULL, num_threads + 1);
+	for (i = 0; i < num_threads; i++) {
+		threads[i].index = i;
+		threads[i].device = devices[i % num_devices];
+		/* spread the total evenly, first threads take the remainder */
+		threads[i].quota = total_ops ? total_ops / num_threads + (i < (int)(total_ops % num_threads)) : 0;
+		if (pthread_create(&threads[i].tid, NULL, thread_fn, &threads[i])) {
+			fprintf(stderr, "cannot create thread %d\n", i);
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	start = now_ns();
+	if (total_ops == 0) {
+		ts.tv_sec = (time_t)duration;
+		ts.tv_nsec = (long)((duration - ts.tv_sec) * 1e9);
+		while (nanosleep(&ts, &ts) && errno == EINTR)
+			;
+		stop = 1;
+	}
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i].tid, NULL);
+	end = now_ns();
+	elapsed = (end - start) / 1e9;
+
+	for (i = 0; i < num_threads; i++) {
+		for (op = 0; op < NUM_OPS; op++) {
+			merge(&total[op], &threads[i].stats[op]);
+			merge(&all, &threads[i].stats[op]);
+		}
+	}
+
+	if (json) {
+		printf("{\n  \"threads\": %d,\n  \"workload\": \"%s\",\n  \"request_size\": %zu,\n  \"elapsed_sec\": %.6f,\n  \"ops\": {\n",
+		       num_threads, mixed ? "mixed" : op_names[workload], req_size, elapsed);
+		for (op = 0; op < NUM_OPS; op++)
+			if (total[op].ops)
+				print_json_row(op_names[op], &total[op], elapsed, 0);
+		print_json_row("total", &all, elapsed, 1);
+		printf("  }\n}\n");
+	}
+	else {
+		printf("workload %s, %d threads, request size %zu, %.3f s\n",
+		       mixed ? "mixed" : op_names[workload], num_threads, req_size, elapsed);
+		printf("%-6s %12s %12s %10s %9s %9s %9s %10s %8s %8s\n",
+		       "op", "ops", "ops/s", "MB/s", "p50_ns", "p99_ns", "p99.9_ns", "max_ns", "errors", "eagain");
+		for (op = 0; op < NUM_OPS; op++)
+			if (total[op].ops)
+				print_text_row(op_names[op], &total[op], elapsed);
+		print_text_row("total", &all, elapsed);
+	}
+
+	return all.errors ? 2 : 0;
+}
@@ -0,0 +1,159 @@
+/* Check that readers of char_example in publish mode (insmod example.ko mode=publish) never see a torn version.
+ * Usage: pub_test <device> [bytes] [readers] [seconds]
+ * Example: pub_test /dev/char_example 100 4 5
+ *
+ * One writer thread keeps replacing the whole buffer (bytes, at most buf_size) with a version in which every byte
+ * is the same value, one write() per version. Reader threads pread() the whole buffer and check that all bytes are
+ * equal, i.e. they got exactly one version. EXAMPLE_IOCTL_GET_GEN is checked to advance by one per write() and
+ * never to go back for readers. Exit code is non-zero on any torn read or generation error.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include "../example_ioctl.h"
+
+#define MAX_BYTES	65536
+#define MAX_READERS	64
+
+static const char *device;
+static size_t bytes;
+static volatile int stop;
+
+struct result {
+	unsigned long long ops;
+	unsigned long long errors;
+};
+
+static int open_device(void)
+{
+	int fd = open(device, O_RDWR);
+
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+	return fd;
+}
+
+static unsigned long long get_gen(int fd)
+{
+	unsigned long long gen;
+
+	if (ioctl(fd, EXAMPLE_IOCTL_GET_GEN, &gen)) {
+		perror("EXAMPLE_IOCTL_GET_GEN");
+		exit(1);
+	}
+	return gen;
+}
+
+static void *writer(void *arg)
+{
+	struct result *r = arg;
+	static unsigned char buf[MAX_BYTES];
+	unsigned long long gen;
+	int fd = open_device();
+
+	while (!stop) {
+		memset(buf, (int)(r->ops & 0xff), bytes);
+		gen = get_gen(fd);
+		if (pwrite(fd, buf, bytes, 0) != (ssize_t)bytes) {
+			perror("pwrite");
+			exit(1);
+		}
+		/* there is only one writer */
+		if (get_gen(fd) != gen + 1)
+			r->errors++;
+		r->ops++;
+	}
+	close(fd);
+	return NULL;
+}
+
+static void *reader(void *arg)
+{
+	struct result *r = arg;
+	unsigned char *buf = malloc(bytes);
+	unsigned long long gen, last = 0;
+	size_t i;
+	int fd = open_device();
+
+	while (!stop) {
+		if (pread(fd, buf, bytes, 0) != (ssize_t)bytes) {
+			perror("pread");
+			exit(1);
+		}
+		for (i = 1; i < bytes && buf[i] == buf[0]; i++)
+			;
+		if (i < bytes) {
+			fprintf(stderr, "torn read: byte 0 is 0x%02x, byte %zu is 0x%02x\n", buf[0], i, buf[i]);
+			r->errors++;
+		}
+		gen = get_gen(fd);
+		if (gen < last)
+			r->errors++;
+		last = gen;
+		r->ops++;
+	}
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct result results[MAX_READERS + 1];
+	pthread_t threads[MAX_READERS + 1];
+	unsigned long long reads = 0, errors = 0;
+	unsigned char *buf;
+	int fd, readers, seconds, i;
+
+	if (argc < 2 || argc > 5) {
+		fprintf(stderr, "usage: %s <device> [bytes] [readers] [seconds]\n", argv[0]);
+		exit(1);
+	}
+	device = argv[1];
+	bytes = argc > 2 ? strtoul(argv[2], NULL, 0) : 100;
+	readers = argc > 3 ? atoi(argv[3]) : 4;
+	seconds = argc > 4 ? atoi(argv[4]) : 5;
+	if (bytes < 2 || bytes > MAX_BYTES || readers < 1 || readers > MAX_READERS || seconds < 1) {
+		fprintf(stderr, "bytes 2 - %d, readers 1 - %d, seconds > 0\n", MAX_BYTES, MAX_READERS);
+		exit(1);
+	}
+
+	/* first version of the test, so readers never see the initial buffer contents */
+	fd = open_device();
+	buf = calloc(1, bytes);
+	if (pwrite(fd, buf, bytes, 0) != (ssize_t)bytes) {
+		perror("pwrite");
+		exit(1);
+	}
+	free(buf);
+	close(fd);
+
+	pthread_create(&threads[0], NULL, writer, &results[0]);
+	for (i = 1; i <= readers; i++)
+		pthread_create(&threads[i], NULL, reader, &results[i]);
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i <= readers; i++) {
+		pthread_join(threads[i], NULL);
+		errors += results[i].errors;
+		if (i)
+			reads += results[i].ops;
+	}
+
+	printf("%llu versions published, %llu reads by %d readers, %llu errors\n", results[0].ops, reads, readers, errors);
+	if (errors) {
+		fprintf(stderr, "publish check FAILED\n");
+		return 1;
+	}
+	printf("publish check OK\n");
+	return 0;
+}
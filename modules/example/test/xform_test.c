@@ -0,0 +1,148 @@
+/* Check the streaming transforms of char_example (buffer mode) against reference values computed here.
+ * Usage: xform_test <device> [bytes]
+ * Example: xform_test /dev/char_example 64
+ *
+ * 1. write() with EXAMPLE_XFORM_UPPER | EXAMPLE_XFORM_XOR | EXAMPLE_XFORM_CRC32: stored bytes and the write CRC-32
+ * 2. read() with EXAMPLE_XFORM_MAP (user table) | EXAMPLE_XFORM_CRC32: returned bytes and the read CRC-32
+ * 3. EXAMPLE_XFORM_XXH64 is either accepted or refused with EOPNOTSUPP (kernel without lib/xxhash)
+ * CRC-32 is the zlib one, implemented bitwise here, itself checked against crc32("123456789") = 0xcbf43926.
+ * bytes must not exceed the device buffer (buf_size, default 100). Exit code is non-zero on mismatch.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "../example_ioctl.h"
+
+#define MAX_BYTES	4096
+
+static int failures;
+
+static uint32_t crc32_ref(const unsigned char *p, size_t len)
+{
+	uint32_t crc = ~0U;
+	int k;
+
+	while (len--) {
+		crc ^= *p++;
+		for (k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (0xedb88320U & -(crc & 1));
+	}
+	return ~crc;
+}
+
+static void check(const char *name, int cond)
+{
+	printf("%-40s %s\n", name, cond ? "OK" : "FAILED");
+	if (!cond)
+		failures++;
+}
+
+static void set_xform(int fd, unsigned int write_flags, unsigned int read_flags, unsigned int xor_key)
+{
+	struct example_xform xf = { write_flags, read_flags, xor_key };
+
+	if (ioctl(fd, EXAMPLE_IOCTL_SET_XFORM, &xf)) {
+		perror("EXAMPLE_IOCTL_SET_XFORM");
+		exit(1);
+	}
+}
+
+static void get_csums(int fd, struct example_csums *cs)
+{
+	if (ioctl(fd, EXAMPLE_IOCTL_GET_CSUM, cs)) {
+		perror("EXAMPLE_IOCTL_GET_CSUM");
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static unsigned char data[MAX_BYTES], expect[MAX_BYTES], got[MAX_BYTES];
+	struct example_xform xf = { EXAMPLE_XFORM_XXH64, 0, 0 };
+	struct example_map map;
+	struct example_csums cs;
+	size_t n, i;
+	int fd;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: %s <device> [bytes]\n", argv[0]);
+		exit(1);
+	}
+	n = argc > 2 ? strtoul(argv[2], NULL, 0) : 64;
+	if (n == 0 || n > MAX_BYTES) {
+		fprintf(stderr, "bytes must be 1 - %d\n", MAX_BYTES);
+		exit(1);
+	}
+
+	check("reference crc32(\"123456789\")", crc32_ref((const unsigned char *)"123456789", 9) == 0xcbf43926);
+
+	if ((fd = open(argv[1], O_RDWR)) < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	/* every byte value, and letters of both cases */
+	for (i = 0; i < n; i++)
+		data[i] = (i & 1) ? 'a' + i % 26 : i * 37;
+
+	/* 1. write side: upper case, then XOR */
+	for (i = 0; i < n; i++)
+		expect[i] = ((data[i] >= 'a' && data[i] <= 'z') ? data[i] ^ 0x20 : data[i]) ^ 0x5a;
+	set_xform(fd, EXAMPLE_XFORM_UPPER | EXAMPLE_XFORM_XOR | EXAMPLE_XFORM_CRC32, 0, 0x5a);
+	if (pwrite(fd, data, n, 0) != (ssize_t)n) {
+		perror("pwrite");
+		exit(1);
+	}
+	get_csums(fd, &cs);
+	check("write checksum bytes", cs.write.bytes == n);
+	check("write CRC-32", cs.write.crc32 == crc32_ref(expect, n));
+
+	/* 2. read side: user table (complement of every byte), stored data is unchanged */
+	for (i = 0; i < 256; i++)
+		map.table[i] = 255 - i;
+	if (ioctl(fd, EXAMPLE_IOCTL_SET_MAP, &map)) {
+		perror("EXAMPLE_IOCTL_SET_MAP");
+		exit(1);
+	}
+	set_xform(fd, 0, EXAMPLE_XFORM_MAP | EXAMPLE_XFORM_CRC32, 0);
+	if (pread(fd, got, n, 0) != (ssize_t)n) {
+		perror("pread");
+		exit(1);
+	}
+	for (i = 0; i < n; i++)
+		expect[i] = 255 - expect[i];
+	check("written bytes, read through the table", memcmp(got, expect, n) == 0);
+	get_csums(fd, &cs);
+	check("read checksum bytes", cs.read.bytes == n);
+	check("read CRC-32", cs.read.crc32 == crc32_ref(expect, n));
+
+	/* without transforms data comes back as stored */
+	set_xform(fd, 0, 0, 0);
+	if (pread(fd, got, n, 0) != (ssize_t)n) {
+		perror("pread");
+		exit(1);
+	}
+	for (i = 0; i < n; i++)
+		expect[i] = 255 - expect[i];
+	check("stored bytes", memcmp(got, expect, n) == 0);
+
+	/* 3. XXH64 */
+	if (ioctl(fd, EXAMPLE_IOCTL_SET_XFORM, &xf) == 0)
+		printf("%-40s supported\n", "XXH64");
+	else
+		check("XXH64 unsupported is EOPNOTSUPP", errno == EOPNOTSUPP);
+
+	close(fd);
+	if (failures) {
+		fprintf(stderr, "transform check FAILED (%d)\n", failures);
+		return 1;
+	}
+	printf("transform check OK\n");
+	return 0;
+}
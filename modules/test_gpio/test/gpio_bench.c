@@ -0,0 +1,524 @@
+/* Toggle rate, access latency and read throughput of every way to drive or sample a pin with test_gpio,
+ * and of the kernel's own gpiolib interfaces as a baseline.
+ * Usage: gpio_bench [options]
+ *   -p <pin>       BCM pin number (default 17)
+ *   -n <count>     operations per method (default 100000)
+ *   -d <device>    test_gpio character device (default /dev/test_gpio-20200000)
+ *   -s <dir>       test_gpio sysfs directory (default /sys/devices/platform/soc/20200000.test_gpio)
+ *   -g <number>    gpiolib global number of the pin, for /sys/class/gpio (default: same as pin)
+ *   -c <chip>      gpiolib character device (default /dev/gpiochip0, line offset is the pin)
+ *   -m <list>      comma separated methods to run (default all), see methods[] below
+ *   -j             print results as JSON
+ * Example: gpio_bench -p 17 -n 200000 -j > release-1.2.json
+ *
+ * Every method is run twice: once untimed, for sustained rate (toggles/s or reads/s), and once with every
+ * operation timed, for the latency distribution. A toggle is one level change, so the output square wave
+ * frequency is half the toggle rate. Methods whose interface is missing are reported as skipped.
+ * Pin is configured as output, and driven, by all toggle methods: do not connect anything that minds.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+/* gpiolib character device ABI is in the kernel headers since 4.8, older toolchains build without those methods */
+#if defined(__has_include)
+#if __has_include(<linux/gpio.h>)
+#include <linux/gpio.h>
+#endif
+#endif
+#include "../test_gpio_ioctl.h"
+
+#define GPSET		0x1c
+#define GPCLR		0x28
+#define GPLEV		0x34
+
+#define REG(base, off)	(*(volatile uint32_t *)((char *)(base) + (off)))
+
+/* Text status table always fits in 1024 bytes */
+#define STATUS_TEXT_SIZE	1024
+
+#define TOGGLE	0
+#define READ	1
+
+struct ctx {
+	int pin;
+	int fd;
+	int fd2;
+	void *regs;
+	char path[256];
+	int exported;		/* pin was exported to /sys/class/gpio by us */
+};
+
+struct method {
+	const char *name;
+	int kind;			/* TOGGLE or READ */
+	int (*setup)(struct ctx *c);
+	int (*op)(struct ctx *c, long i);
+	void (*teardown)(struct ctx *c);
+};
+
+static const char *device = "/dev/test_gpio-20200000";
+static const char *sysfs_dir = "/sys/devices/platform/soc/20200000.test_gpio";
+static const char *gpiochip = "/dev/gpiochip0";
+static int gpiolib_num = -1;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int write_str(const char *path, const char *s)
+{
+	int fd, ret;
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, s, strlen(s)) == (ssize_t)strlen(s) ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+/* Every toggle method starts with the pin configured as output through the driver */
+static int make_output(struct ctx *c)
+{
+	struct test_gpio_masks m = { .output = 1ULL << c->pin, .clear = 1ULL << c->pin };
+	int fd, ret;
+
+	fd = open(device, O_RDWR);
+	if (fd < 0)
+		return -1;
+	ret = ioctl(fd, TEST_GPIO_IOCTL_SET_MASKS, &m);
+	close(fd);
+	return ret;
+}
+
+static void close_fds(struct ctx *c)
+{
+	if (c->fd >= 0)
+		close(c->fd);
+	if (c->fd2 >= 0)
+		close(c->fd2);
+}
+
+/******************************************************************************
+ * test_gpio character device
+ *****************************************************************************/
+
+static int chr_open(struct ctx *c)
+{
+	c->fd = open(device, O_RDWR);
+	return c->fd < 0 ? -1 : 0;
+}
+
+static int chr_text_setup(struct ctx *c)
+{
+	return chr_open(c);
+}
+
+static int chr_text_toggle(struct ctx *c, long i)
+{
+	char cmd[16];
+	int len = snprintf(cmd, sizeof(cmd), "%d %s\n", c->pin, (i & 1) ? "low" : "high");
+
+	return write(c->fd, cmd, len) == len ? 0 : -1;
+}
+
+static int chr_binary_setup(struct ctx *c)
+{
+	int mode = TEST_GPIO_WRITE_BINARY;
+
+	if (chr_open(c))
+		return -1;
+	return ioctl(c->fd, TEST_GPIO_IOCTL_SET_WRITE_MODE, &mode);
+}
+
+static int chr_binary_toggle(struct ctx *c, long i)
+{
+	struct test_gpio_op op = { .pin = c->pin, .op = (i & 1) ? TEST_GPIO_OP_LOW : TEST_GPIO_OP_HIGH };
+
+	return write(c->fd, &op, sizeof(op)) == sizeof(op) ? 0 : -1;
+}
+
+static int chr_masks_setup(struct ctx *c)
+{
+	if (chr_open(c))
+		return -1;
+	return make_output(c);
+}
+
+static int chr_masks_toggle(struct ctx *c, long i)
+{
+	struct test_gpio_masks m = { 0 };
+
+	if (i & 1)
+		m.clear = 1ULL << c->pin;
+	else
+		m.set = 1ULL << c->pin;
+	return ioctl(c->fd, TEST_GPIO_IOCTL_SET_MASKS, &m);
+}
+
+static int chr_text_read(struct ctx *c, long i)
+{
+	char buf[STATUS_TEXT_SIZE];
+
+	return pread(c->fd, buf, sizeof(buf), 0) > 0 ? 0 : -1;
+}
+
+static int chr_binary_read_setup(struct ctx *c)
+{
+	int mode = TEST_GPIO_READ_BINARY;
+
+	if (chr_open(c))
+		return -1;
+	return ioctl(c->fd, TEST_GPIO_IOCTL_SET_READ_MODE, &mode);
+}
+
+static int chr_binary_read(struct ctx *c, long i)
+{
+	struct test_gpio_status st;
+
+	return read(c->fd, &st, sizeof(st)) == sizeof(st) ? 0 : -1;
+}
+
+static int chr_status_read(struct ctx *c, long i)
+{
+	struct test_gpio_status st;
+
+	return ioctl(c->fd, TEST_GPIO_IOCTL_GET_STATUS, &st);
+}
+
+/******************************************************************************
+ * test_gpio register page mapped with mmap()
+ *****************************************************************************/
+
+static int mmap_setup(struct ctx *c)
+{
+	if (make_output(c))
+		return -1;
+	c->fd = open(device, O_RDWR | O_SYNC);
+	if (c->fd < 0)
+		return -1;
+	c->regs = mmap(NULL, getpagesize(), PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+	if (c->regs == MAP_FAILED) {
+		c->regs = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static int mmap_toggle(struct ctx *c, long i)
+{
+	REG(c->regs, ((i & 1) ? GPCLR : GPSET) + (c->pin / 32) * 4) = 1u << (c->pin % 32);
+	return 0;
+}
+
+static volatile uint32_t level_sink;
+
+static int mmap_read(struct ctx *c, long i)
+{
+	level_sink = (REG(c->regs, GPLEV + (c->pin / 32) * 4) >> (c->pin % 32)) & 1;
+	return 0;
+}
+
+static void mmap_teardown(struct ctx *c)
+{
+	if (c->regs)
+		munmap(c->regs, getpagesize());
+	close_fds(c);
+}
+
+/******************************************************************************
+ * sysfs value files: test_gpio testgpioN/value, gpiolib /sys/class/gpio/gpioN/value
+ * File stays open, every access is one pread()/pwrite() at offset 0.
+ *****************************************************************************/
+
+static int sysfs_open_value(struct ctx *c)
+{
+	c->fd = open(c->path, O_RDWR);
+	return c->fd < 0 ? -1 : 0;
+}
+
+static int sysfs_setup(struct ctx *c)
+{
+	snprintf(c->path, sizeof(c->path), "%s/testgpio%d/value", sysfs_dir, c->pin);
+	return sysfs_open_value(c);
+}
+
+static int sysfs_toggle(struct ctx *c, long i)
+{
+	return pwrite(c->fd, (i & 1) ? "0" : "1", 1, 0) == 1 ? 0 : -1;
+}
+
+static int sysfs_read(struct ctx *c, long i)
+{
+	char buf[4];
+
+	return pread(c->fd, buf, sizeof(buf), 0) > 0 ? 0 : -1;
+}
+
+static int gpiolib_sysfs_setup(struct ctx *c)
+{
+	char num[16], dir[64];
+
+	snprintf(num, sizeof(num), "%d", gpiolib_num);
+	snprintf(dir, sizeof(dir), "/sys/class/gpio/gpio%d/direction", gpiolib_num);
+	if (access(dir, F_OK) != 0) {
+		if (write_str("/sys/class/gpio/export", num))
+			return -1;
+		c->exported = 1;
+	}
+	if (write_str(dir, "out"))
+		return -1;
+	snprintf(c->path, sizeof(c->path), "/sys/class/gpio/gpio%d/value", gpiolib_num);
+	return sysfs_open_value(c);
+}
+
+static void gpiolib_sysfs_teardown(struct ctx *c)
+{
+	char num[16];
+
+	close_fds(c);
+	if (c->exported) {
+		snprintf(num, sizeof(num), "%d", gpiolib_num);
+		write_str("/sys/class/gpio/unexport", num);
+	}
+}
+
+/******************************************************************************
+ * gpiolib character device (/dev/gpiochipN, line handle ABI)
+ *****************************************************************************/
+
+#ifdef GPIO_GET_LINEHANDLE_IOCTL
+static int gpiolib_cdev_setup(struct ctx *c, unsigned int flags)
+{
+	struct gpiohandle_request req;
+
+	c->fd2 = open(gpiochip, O_RDWR);
+	if (c->fd2 < 0)
+		return -1;
+	memset(&req, 0, sizeof(req));
+	req.lineoffsets[0] = c->pin;
+	req.lines = 1;
+	req.flags = flags;
+	snprintf(req.consumer_label, sizeof(req.consumer_label), "gpio_bench");
+	if (ioctl(c->fd2, GPIO_GET_LINEHANDLE_IOCTL, &req))
+		return -1;
+	c->fd = req.fd;
+	return 0;
+}
+
+static int gpiolib_cdev_out_setup(struct ctx *c)
+{
+	return gpiolib_cdev_setup(c, GPIOHANDLE_REQUEST_OUTPUT);
+}
+
+static int gpiolib_cdev_in_setup(struct ctx *c)
+{
+	return gpiolib_cdev_setup(c, GPIOHANDLE_REQUEST_INPUT);
+}
+
+static int gpiolib_cdev_toggle(struct ctx *c, long i)
+{
+	struct gpiohandle_data data = { .values = { !(i & 1) } };
+
+	return ioctl(c->fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data);
+}
+
+static int gpiolib_cdev_read(struct ctx *c, long i)
+{
+	struct gpiohandle_data data;
+
+	return ioctl(c->fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data);
+}
+#else
+/* built against headers without the line handle ABI: reported as skipped */
+static int gpiolib_cdev_out_setup(struct ctx *c)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#define gpiolib_cdev_in_setup	gpiolib_cdev_out_setup
+#define gpiolib_cdev_toggle		NULL
+#define gpiolib_cdev_read		NULL
+#endif
+
+static const struct method methods[] = {
+	{ "chardev-text",		TOGGLE,	chr_text_setup,			chr_text_toggle,	close_fds },
+	{ "chardev-binary",		TOGGLE,	chr_binary_setup,		chr_binary_toggle,	close_fds },
+	{ "ioctl-masks",		TOGGLE,	chr_masks_setup,		chr_masks_toggle,	close_fds },
+	{ "mmap",				TOGGLE,	mmap_setup,				mmap_toggle,		mmap_teardown },
+	{ "sysfs",				TOGGLE,	sysfs_setup,			sysfs_toggle,		close_fds },
+	{ "gpiolib-sysfs",		TOGGLE,	gpiolib_sysfs_setup,	sysfs_toggle,		gpiolib_sysfs_teardown },
+	{ "gpiolib-cdev",		TOGGLE,	gpiolib_cdev_out_setup,	gpiolib_cdev_toggle,	close_fds },
+	{ "chardev-text-read",	READ,	chr_text_setup,			chr_text_read,		close_fds },
+	{ "chardev-binary-read",	READ,	chr_binary_read_setup,	chr_binary_read,	close_fds },
+	{ "ioctl-status",		READ,	chr_text_setup,			chr_status_read,	close_fds },
+	{ "mmap-read",			READ,	mmap_setup,				mmap_read,			mmap_teardown },
+	{ "sysfs-read",			READ,	sysfs_setup,			sysfs_read,			close_fds },
+	{ "gpiolib-sysfs-read",	READ,	gpiolib_sysfs_setup,	sysfs_read,			gpiolib_sysfs_teardown },
+	{ "gpiolib-cdev-read",	READ,	gpiolib_cdev_in_setup,	gpiolib_cdev_read,	close_fds },
+};
+#define NUM_METHODS	(sizeof(methods) / sizeof(methods[0]))
+
+struct result {
+	int skipped;
+	int errors;
+	double rate;		/* operations per second, untimed run */
+	uint64_t p50, p99, p999, max;	/* ns */
+};
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void run(const struct method *m, int pin, long count, uint32_t *lat, struct result *r)
+{
+	struct ctx c = { .pin = pin, .fd = -1, .fd2 = -1 };
+	uint64_t start, t;
+	long i;
+
+	memset(r, 0, sizeof(*r));
+	if (m->setup(&c)) {
+		fprintf(stderr, "%s: skipped (%s)\n", m->name, strerror(errno));
+		m->teardown(&c);
+		r->skipped = 1;
+		return;
+	}
+
+	start = now_ns();
+	for (i = 0; i < count; i++)
+		r->errors += m->op(&c, i) != 0;
+	r->rate = count / ((now_ns() - start) / 1e9);
+
+	for (i = 0; i < count; i++) {
+		t = now_ns();
+		r->errors += m->op(&c, i) != 0;
+		t = now_ns() - t;
+		lat[i] = t > UINT32_MAX ? UINT32_MAX : t;
+	}
+	m->teardown(&c);
+
+	qsort(lat, count, sizeof(*lat), cmp_u32);
+	r->p50 = lat[count / 2];
+	r->p99 = lat[(long)(count * 0.99)];
+	r->p999 = lat[(long)(count * 0.999)];
+	r->max = lat[count - 1];
+}
+
+static int selected(const char *list, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p;
+
+	if (list == NULL)
+		return 1;
+	for (p = list; (p = strstr(p, name)) != NULL; p += len) {
+		if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0'))
+			return 1;
+	}
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	unsigned int i;
+
+	fprintf(stderr, "usage: %s [-p pin] [-n count] [-d device] [-s sysfs_dir] [-g gpiolib_number] [-c gpiochip] [-m methods] [-j]\n"
+	        "methods:", prog);
+	for (i = 0; i < NUM_METHODS; i++)
+		fprintf(stderr, " %s", methods[i].name);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct result results[NUM_METHODS];
+	const char *list = NULL;
+	int opt, pin = 17, json = 0, first = 1;
+	long count = 100000;
+	unsigned int i;
+	uint32_t *lat;
+
+	while ((opt = getopt(argc, argv, "p:n:d:s:g:c:m:j")) != -1) {
+		switch (opt) {
+		case 'p': pin = atoi(optarg); break;
+		case 'n': count = atol(optarg); break;
+		case 'd': device = optarg; break;
+		case 's': sysfs_dir = optarg; break;
+		case 'g': gpiolib_num = atoi(optarg); break;
+		case 'c': gpiochip = optarg; break;
+		case 'm': list = optarg; break;
+		case 'j': json = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc || pin < 0 || pin > 53 || count <= 0)
+		usage(argv[0]);
+	if (gpiolib_num < 0)
+		gpiolib_num = pin;
+
+	lat = malloc(count * sizeof(*lat));
+	if (lat == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (i = 0; i < NUM_METHODS; i++) {
+		results[i].skipped = 1;
+		if (selected(list, methods[i].name))
+			run(&methods[i], pin, count, lat, &results[i]);
+	}
+
+	if (json) {
+		printf("{\n  \"pin\": %d,\n  \"count\": %ld,\n  \"methods\": {", pin, count);
+		for (i = 0; i < NUM_METHODS; i++) {
+			if (!selected(list, methods[i].name))
+				continue;
+			printf("%s\n    \"%s\": ", first ? "" : ",", methods[i].name);
+			first = 0;
+			if (results[i].skipped) {
+				printf("{\"skipped\": true}");
+				continue;
+			}
+			printf("{\"kind\": \"%s\", \"ops_per_sec\": %.1f, \"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, "
+			       "\"max_ns\": %llu, \"errors\": %d}",
+			       methods[i].kind == TOGGLE ? "toggle" : "read", results[i].rate,
+			       (unsigned long long)results[i].p50, (unsigned long long)results[i].p99,
+			       (unsigned long long)results[i].p999, (unsigned long long)results[i].max, results[i].errors);
+		}
+		printf("\n  }\n}\n");
+	}
+	else {
+		printf("pin %d, %ld operations per method\n", pin, count);
+		printf("%-20s %-6s %12s %12s %9s %9s %9s %10s %7s\n",
+		       "method", "kind", "ops/s", "square_Hz", "p50_ns", "p99_ns", "p99.9_ns", "max_ns", "errors");
+		for (i = 0; i < NUM_METHODS; i++) {
+			if (results[i].skipped)
+				continue;
+			printf("%-20s %-6s %12.0f %12.0f %9llu %9llu %9llu %10llu %7d\n", methods[i].name,
+			       methods[i].kind == TOGGLE ? "toggle" : "read", results[i].rate,
+			       methods[i].kind == TOGGLE ? results[i].rate / 2 : 0,
+			       (unsigned long long)results[i].p50, (unsigned long long)results[i].p99,
+			       (unsigned long long)results[i].p999, (unsigned long long)results[i].max, results[i].errors);
+		}
+	}
+
+	free(lat);
+	return 0;
+}
@@ -0,0 +1,105 @@
+/* Capture pin levels with the test_gpio logic analyzer mode and print them as run-length records.
+ * Usage: gpio_capture [-m] <device> <period_ns> <pin_mask> <samples>
+ * Example: gpio_capture /dev/test_gpio-20200000 1000 0x60000 1000000
+ *
+ * Records are read in bulk with read() while the capture runs, or with -m, taken from the mapped
+ * capture buffer after it has finished. Every output line is "<time_ns> <levels> <count>",
+ * time relative to the first sample.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "../test_gpio_ioctl.h"
+
+#define READ_RECORDS	4096
+
+static uint64_t print_records(const struct test_gpio_sample *s, size_t n, uint64_t period_ns, uint64_t t)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		printf("%llu 0x%014llx %u\n", (unsigned long long)t, (unsigned long long)s[i].levels, s[i].count);
+		t += s[i].count * period_ns;
+	}
+	return t;
+}
+
+int main(int argc, char *argv[])
+{
+	struct test_gpio_capture cap;
+	struct test_gpio_capture_status st;
+	static struct test_gpio_sample buf[READ_RECORDS];
+	struct test_gpio_sample *map;
+	int fd, mode = TEST_GPIO_READ_CAPTURE, use_mmap = 0, arg = 1;
+	uint64_t t = 0;
+	ssize_t n;
+
+	if (argc > 1 && strcmp(argv[1], "-m") == 0) {
+		use_mmap = 1;
+		arg++;
+	}
+	if (argc - arg != 4) {
+		fprintf(stderr, "usage: %s [-m] <device> <period_ns> <pin_mask> <samples>\n", argv[0]);
+		exit(1);
+	}
+
+	memset(&cap, 0, sizeof(cap));
+	cap.period_ns = strtoull(argv[arg + 1], NULL, 0);
+	cap.pin_mask = strtoull(argv[arg + 2], NULL, 0);
+	cap.samples = strtoull(argv[arg + 3], NULL, 0);
+	if (cap.samples == 0) {
+		fprintf(stderr, "samples must be > 0\n");
+		exit(1);
+	}
+
+	if ((fd = open(argv[arg], O_RDONLY)) < 0) {
+		perror("open");
+		exit(1);
+	}
+	if (ioctl(fd, TEST_GPIO_IOCTL_SET_READ_MODE, &mode) || ioctl(fd, TEST_GPIO_IOCTL_CAPTURE_START, &cap)) {
+		perror("ioctl");
+		exit(1);
+	}
+
+	if (!use_mmap) {
+		/* returns 0 once the capture has stopped and every record was read */
+		while ((n = read(fd, buf, sizeof(buf))) > 0)
+			t = print_records(buf, n / sizeof(buf[0]), cap.period_ns, t);
+		if (n < 0) {
+			perror("read");
+			exit(1);
+		}
+		if (ioctl(fd, TEST_GPIO_IOCTL_CAPTURE_STATUS, &st)) {
+			perror("ioctl");
+			exit(1);
+		}
+	}
+	else {
+		do {
+			usleep(10000);
+			if (ioctl(fd, TEST_GPIO_IOCTL_CAPTURE_STATUS, &st)) {
+				perror("ioctl");
+				exit(1);
+			}
+		} while (st.running);
+
+		map = mmap(NULL, st.size * sizeof(*map), PROT_READ, MAP_SHARED, fd, TEST_GPIO_MMAP_CAPTURE);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+		print_records(map, st.records, cap.period_ns, 0);
+		munmap(map, st.size * sizeof(*map));
+	}
+
+	fprintf(stderr, "%u records, %llu samples, %llu missed periods%s\n", st.records,
+			(unsigned long long)st.samples, (unsigned long long)st.missed, st.overflow ? ", buffer full" : "");
+	close(fd);
+	return 0;
+}
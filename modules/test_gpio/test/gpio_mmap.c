@@ -0,0 +1,180 @@
+/* Toggle GPIO pin through the mmap()-ed test_gpio register page, without any syscall per toggle.
+ * Usage: gpio_mmap <device|--sim> <pin> <count>
+ * Example: gpio_mmap /dev/test_gpio-20200000 17 1000000
+ *
+ * Pin is made an output with TEST_GPIO_IOCTL_SET_MASKS: GPFSEL belongs to the driver, which changes it under its lock,
+ * so the mapping is used only for GPSET/GPCLR/GPLEV and GPFSEL must never be written through it.
+ *
+ * With --sim, an anonymous page stands in for the register block, so the program can be built and run on the host.
+ * GPSET/GPCLR writes are applied to GPLEV as the hardware does, the pin level is checked after every write, and at
+ * the end GPFSEL and GPLEV must differ from their initial pattern only in the bits of the pin. Exit code is non-zero
+ * on mismatch.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include "../test_gpio_ioctl.h"
+
+#define GPFSEL		0x0
+#define GPSET		0x1c
+#define GPCLR		0x28
+#define GPLEV		0x34
+
+/* --sim: every other pin has an alternate function (ALT0) and a mixed level, so stray bits show up */
+#define SIM_FSEL	0x24924924u
+#define SIM_LEV		0xa5a5a5a5u
+
+#define REG(base, off)	(*(volatile uint32_t *)((char *)(base) + (off)))
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* --sim: GPSET/GPCLR are write-1-to-act, their effect shows up in GPLEV */
+static void sim_write(void *regs, int off, uint32_t val)
+{
+	if (off == GPSET || off == GPSET + 4)
+		REG(regs, GPLEV + off - GPSET) |= val;
+	else if (off == GPCLR || off == GPCLR + 4)
+		REG(regs, GPLEV + off - GPCLR) &= ~val;
+	else
+		REG(regs, off) = val;
+}
+
+static void sim_init(void *regs)
+{
+	int reg;
+
+	for (reg = 0; reg < 6; reg++)
+		REG(regs, GPFSEL + reg * 4) = SIM_FSEL;
+	REG(regs, GPLEV) = SIM_LEV;
+	REG(regs, GPLEV + 4) = SIM_LEV & 0x3fffff;
+}
+
+/* Configure pin as output, driven low. --sim: what the driver does for the ioctl, on the simulated page. */
+static void make_output(int fd, void *regs, int pin)
+{
+	struct test_gpio_masks m = { .clear = 1ULL << pin, .output = 1ULL << pin };
+	int fsel_off = GPFSEL + (pin / 10) * 4, fsel_shift = (pin % 10) * 3;
+
+	if (fd >= 0) {
+		if (ioctl(fd, TEST_GPIO_IOCTL_SET_MASKS, &m)) {
+			perror("TEST_GPIO_IOCTL_SET_MASKS");
+			exit(1);
+		}
+		return;
+	}
+	sim_write(regs, GPCLR + (pin / 32) * 4, 1u << (pin % 32));
+	sim_write(regs, fsel_off, (REG(regs, fsel_off) & ~(7u << fsel_shift)) | (1u << fsel_shift));
+}
+
+/* Pin must end up as an output and low, every other bit as sim_init() left it */
+static long sim_check(void *regs, int pin)
+{
+	long errors = 0;
+	uint32_t expect;
+	int reg;
+
+	for (reg = 0; reg < 6; reg++) {
+		expect = SIM_FSEL;
+		if (reg == pin / 10)
+			expect = (expect & ~(7u << (pin % 10) * 3)) | (1u << (pin % 10) * 3);
+		errors += REG(regs, GPFSEL + reg * 4) != expect;
+	}
+	for (reg = 0; reg < 2; reg++) {
+		expect = reg ? SIM_LEV & 0x3fffff : SIM_LEV;
+		if (reg == pin / 32)
+			expect &= ~(1u << (pin % 32));
+		errors += REG(regs, GPLEV + reg * 4) != expect;
+	}
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	int fd = -1, sim, pin, set_off, clr_off, lev_off;
+	long i, count, errors = 0;
+	uint32_t bit;
+	void *regs;
+	double start, elapsed;
+
+	if (argc != 4) {
+		fprintf(stderr, "usage: %s <device|--sim> <pin> <count>\n", argv[0]);
+		exit(1);
+	}
+
+	sim = (strcmp(argv[1], "--sim") == 0);
+	pin = atoi(argv[2]);
+	count = atol(argv[3]);
+	if (pin < 0 || pin > 53 || count <= 0) {
+		fprintf(stderr, "invalid pin or count\n");
+		exit(1);
+	}
+
+	if (sim) {
+		regs = mmap(NULL, getpagesize(), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (regs != MAP_FAILED)
+			sim_init(regs);
+	}
+	else {
+		if ((fd = open(argv[1], O_RDWR | O_SYNC)) < 0) {
+			perror("open");
+			exit(1);
+		}
+		regs = mmap(NULL, getpagesize(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if (regs == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	make_output(fd, regs, pin);
+
+	bit = 1u << (pin % 32);
+	set_off = GPSET + (pin / 32) * 4;
+	clr_off = GPCLR + (pin / 32) * 4;
+	lev_off = GPLEV + (pin / 32) * 4;
+	start = now_sec();
+	if (sim) {
+		for (i = 0; i < count; i++) {
+			sim_write(regs, set_off, bit);
+			errors += !(REG(regs, lev_off) & bit);
+			sim_write(regs, clr_off, bit);
+			errors += !!(REG(regs, lev_off) & bit);
+		}
+	}
+	else {
+		for (i = 0; i < count; i++) {
+			REG(regs, set_off) = bit;
+			REG(regs, clr_off) = bit;
+		}
+	}
+	elapsed = now_sec() - start;
+
+	printf("pin %d: %ld toggles in %.6f s, %.0f toggles/s\n", pin, count, elapsed, count / elapsed);
+
+	if (sim) {
+		errors += sim_check(regs, pin);
+		if (errors) {
+			fprintf(stderr, "simulated register check FAILED (%ld errors)\n", errors);
+			exit(1);
+		}
+		printf("simulated register check OK\n");
+	}
+
+	munmap(regs, getpagesize());
+	if (fd >= 0)
+		close(fd);
+	return 0;
+}
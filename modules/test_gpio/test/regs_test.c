@@ -0,0 +1,283 @@
+/* Host test and microbenchmark of the test_gpio register logic (../test_gpio_regs.h).
+ * Usage: regs_test [iterations]
+ *
+ * The driver's reg_read()/reg_write() backend is replaced by a simulated 0xb4 byte register block, which logs
+ * every write and applies GPSET/GPCLR writes to GPLEV. Each operation is first checked for its exact sequence of
+ * register writes, then timed in a loop; exit code is non-zero on mismatch. Pin group (bus) lookup tables are checked
+ * by a write/read round trip of every value.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "../test_gpio_ioctl.h"
+
+/* Kernel shims, just enough for test_gpio_regs.h */
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int spinlock_t;
+#define __iomem
+#define BIT_ULL(n)	(1ULL << (n))
+#define READ_ONCE(x)	(*(volatile typeof(x) *)&(x))
+#define spin_lock_init(lock)				(*(lock) = 0)
+#define spin_lock_irqsave(lock, flags)		((void)(lock), (flags) = 0)
+#define spin_unlock_irqrestore(lock, flags)	((void)(lock), (void)(flags))
+#define trace_test_gpio_pin(pin, op, ret)	do { } while (0)
+
+#include "../test_gpio_regs.h"
+
+#define NUM_REGS	(0xb4 / 4)
+#define LOG_SIZE	64
+
+struct reg_op {
+	int off;
+	u32 val;
+};
+
+static u32 sim_regs[NUM_REGS];
+static struct reg_op sim_log[LOG_SIZE];
+static int sim_nlog;
+static int logging = 1;
+static int failures;
+
+static inline u32 reg_read(struct test_gpio_regs *hw, int off)
+{
+	return ((volatile u32 *)hw->base)[off / 4];
+}
+
+static inline void reg_write(struct test_gpio_regs *hw, u32 val, int off)
+{
+	volatile u32 *regs = hw->base;
+
+	/* GPSET/GPCLR are write-1-to-act, their effect shows up in GPLEV */
+	if (off == GPSET || off == GPSET + 4)
+		regs[(GPLEV + off - GPSET) / 4] |= val;
+	else if (off == GPCLR || off == GPCLR + 4)
+		regs[(GPLEV + off - GPCLR) / 4] &= ~val;
+	else
+		regs[off / 4] = val;
+
+	if (logging && sim_nlog < LOG_SIZE) {
+		sim_log[sim_nlog].off = off;
+		sim_log[sim_nlog].val = val;
+		sim_nlog++;
+	}
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Compare the logged writes with the expected {off, val} list, then clear the log */
+static void expect(const char *name, const struct reg_op *ops, int n)
+{
+	int i, ok = (sim_nlog == n);
+
+	for (i = 0; ok && i < n; i++)
+		ok = (sim_log[i].off == ops[i].off && sim_log[i].val == ops[i].val);
+
+	if (!ok) {
+		failures++;
+		fprintf(stderr, "%s: FAILED, expected %d writes:", name, n);
+		for (i = 0; i < n; i++)
+			fprintf(stderr, " [0x%02x]=0x%08x", ops[i].off, ops[i].val);
+		fprintf(stderr, "\n  got %d writes:", sim_nlog);
+		for (i = 0; i < sim_nlog; i++)
+			fprintf(stderr, " [0x%02x]=0x%08x", sim_log[i].off, sim_log[i].val);
+		fprintf(stderr, "\n");
+	}
+	sim_nlog = 0;
+}
+
+#define EXPECT(name, ...) do { \
+		const struct reg_op ops[] = { __VA_ARGS__ }; \
+		expect(name, ops, sizeof(ops) / sizeof(ops[0])); \
+	} while (0)
+
+#define EXPECT_NONE(name)	expect(name, NULL, 0)
+
+static void check(const char *name, int cond)
+{
+	if (!cond) {
+		failures++;
+		fprintf(stderr, "%s: FAILED\n", name);
+	}
+}
+
+static void test_writes(struct test_gpio_regs *hw)
+{
+	struct test_gpio_masks masks;
+	struct test_gpio_status status;
+
+	check("set_output high", set_output(hw, 17, OUTPUT_HIGH) == 0);
+	EXPECT("set_output high", { GPSET, 1 << 17 }, { GPFSEL + 4, 1 << 21 });
+	check("GPLEV after set", sim_regs[GPLEV / 4] == 1 << 17);
+
+	/* pin already is an output, only the level register is written */
+	set_output(hw, 17, OUTPUT_LOW);
+	EXPECT("set_output low, already output", { GPCLR, 1 << 17 });
+	set_output(hw, 17, OUTPUT_LOW);
+	EXPECT("set_output low, repeated", { GPCLR, 1 << 17 });
+	check("GPLEV after clear", sim_regs[GPLEV / 4] == 0);
+
+	set_input(hw, 17);
+	EXPECT("set_input", { GPFSEL + 4, 0 });
+	set_input(hw, 17);
+	EXPECT_NONE("set_input, already input");
+
+	check("invalid level", set_output(hw, 17, OUTPUT_MAX) == -EINVAL);
+	EXPECT_NONE("invalid level");
+
+	set_output(hw, 40, OUTPUT_HIGH);
+	EXPECT("set_output bank 1", { GPSET + 4, 1 << 8 }, { GPFSEL + 16, 1 });
+
+	/* levels first (GPCLR0/1, GPSET0/1), then each touched GPFSEL once, in ascending order */
+	masks.set = BIT_ULL(2) | BIT_ULL(35);
+	masks.clear = BIT_ULL(3) | BIT_ULL(40);
+	masks.output = BIT_ULL(2) | BIT_ULL(3) | BIT_ULL(35);
+	masks.input = BIT_ULL(40) | BIT_ULL(53);
+	check("set_masks", set_masks(hw, &masks) == 0);
+	EXPECT("set_masks",
+		   { GPCLR, 1 << 3 }, { GPCLR + 4, 1 << 8 }, { GPSET, 1 << 2 }, { GPSET + 4, 1 << 3 },
+		   { GPFSEL, (1 << 6) | (1 << 9) }, { GPFSEL + 12, 1 << 15 }, { GPFSEL + 16, 0 });
+
+	masks.set = masks.clear = BIT_ULL(5);
+	masks.output = masks.input = 0;
+	check("set_masks, set and clear overlap", set_masks(hw, &masks) == -EINVAL);
+	masks.set = masks.clear = 0;
+	masks.output = masks.input = BIT_ULL(5);
+	check("set_masks, output and input overlap", set_masks(hw, &masks) == -EINVAL);
+	masks.output = BIT_ULL(54);
+	masks.input = 0;
+	check("set_masks, pin out of range", set_masks(hw, &masks) == -EINVAL);
+	EXPECT_NONE("invalid set_masks");
+
+	/* direction changes still take effect after pin functions were changed behind the driver's back */
+	sim_regs[GPFSEL / 4 + 1] |= 1 << 21;
+	set_input(hw, 17);
+	EXPECT("set_input after outside change", { GPFSEL + 4, 0 });
+	sim_regs[GPFSEL / 4 + 1] |= 1 << 24;
+	set_output(hw, 17, OUTPUT_LOW);
+	EXPECT("set_output keeps outside change", { GPCLR, 1 << 17 }, { GPFSEL + 4, (1 << 21) | (1 << 24) });
+	set_input(hw, 17);
+	set_input(hw, 18);
+	sim_nlog = 0;
+
+	/* function changed behind the driver's back is picked up by get_status */
+	sim_regs[GPFSEL / 4 + 2] = 4 << 3;
+	get_status(hw, &status);
+	EXPECT_NONE("get_status");
+	check("get_status fsel", status.fsel[2] == 4 << 3 && hw->fsel[2] == 4 << 3);
+	check("get_status level", status.level == (BIT_ULL(2) | BIT_ULL(35)));
+}
+
+/* 8-bit bus on pins scattered over both banks, out of order */
+static const int bus_pins[8] = { 17, 4, 40, 27, 33, 2, 50, 9 };
+
+static void test_bus(struct test_gpio_regs *hw, struct test_gpio_bus *bus)
+{
+	const int dup_pins[2] = { 5, 5 }, bad_pins[1] = { NUM_GPIOS };
+	u32 v;
+	int ok = 1;
+
+	check("bus_init, duplicate pin", bus_init(bus, dup_pins, 2) == -EINVAL);
+	check("bus_init, pin out of range", bus_init(bus, bad_pins, 1) == -EINVAL);
+	check("bus_init", bus_init(bus, bus_pins, 8) == 0);
+
+	/* start from all inputs and low levels */
+	memset(sim_regs, 0, sizeof(sim_regs));
+	regs_init(hw);
+
+	/* 0xa5: bits 0, 2, 5, 7 high (pins 17, 40, 2, 9), bits 1, 3, 4, 6 low (pins 4, 27, 33, 50) */
+	check("bus_write 0xa5", bus_write(hw, bus, 0xa5) == 0);
+	EXPECT("bus_write 0xa5, pins still inputs",
+		   { GPCLR, (1 << 4) | (1 << 27) }, { GPCLR + 4, (1 << 1) | (1 << 18) },
+		   { GPSET, (1 << 17) | (1 << 2) | (1 << 9) }, { GPSET + 4, 1 << 8 },
+		   { GPFSEL, (1 << 6) | (1 << 12) | (1 << 27) }, { GPFSEL + 4, 1 << 21 }, { GPFSEL + 8, 1 << 21 },
+		   { GPFSEL + 12, 1 << 9 }, { GPFSEL + 16, 1 }, { GPFSEL + 20, 1 });
+	check("bus_read 0xa5", bus_read(hw, bus) == 0xa5);
+
+	bus_write(hw, bus, 0);
+	EXPECT("bus_write 0", { GPCLR, (1 << 17) | (1 << 4) | (1 << 27) | (1 << 2) | (1 << 9) },
+		   { GPCLR + 4, (1 << 8) | (1 << 1) | (1 << 18) });
+
+	check("bus_write, value too wide", bus_write(hw, bus, 0x100) == -EINVAL);
+	EXPECT_NONE("bus_write, value too wide");
+
+	/* pins outside the bus do not show up in the value */
+	sim_regs[GPLEV / 4] |= 1 << 3;
+	sim_regs[GPLEV / 4 + 1] |= 1 << 20;
+	for (v = 0; v < 256 && ok; v++) {
+		bus_write(hw, bus, v);
+		ok = (bus_read(hw, bus) == v);
+	}
+	sim_nlog = 0;
+	check("bus_write/bus_read round trip", ok);
+}
+
+#define BENCH(name, iterations, body) do { \
+		long i_; \
+		double start_ = now_sec(); \
+		for (i_ = 0; i_ < (iterations); i_++) { body; } \
+		printf("%-32s %8.2f ns/op\n", name, (now_sec() - start_) * 1e9 / (iterations)); \
+	} while (0)
+
+static void bench(struct test_gpio_regs *hw, struct test_gpio_bus *bus, long n)
+{
+	struct test_gpio_masks masks = { 0 };
+	struct test_gpio_status status;
+	volatile u64 sink;
+
+	logging = 0;
+	BENCH("set_output, level change", n, set_output(hw, 17, (i_ & 1) ? OUTPUT_HIGH : OUTPUT_LOW));
+	BENCH("set_output + set_input", n, { set_output(hw, 18, OUTPUT_HIGH); set_input(hw, 18); });
+	BENCH("write_levels", n, write_levels(hw, (i_ & 1) ? BIT_ULL(17) : 0, (i_ & 1) ? 0 : BIT_ULL(17)));
+	masks.output = GPIO_ALL_MASK;
+	BENCH("set_masks, all pins, no change", n, set_masks(hw, &masks));
+	BENCH("set_masks, all pins, toggle", n, {
+		masks.set = (i_ & 1) ? GPIO_ALL_MASK : 0;
+		masks.clear = (i_ & 1) ? 0 : GPIO_ALL_MASK;
+		masks.output = (i_ & 1) ? GPIO_ALL_MASK : 0;
+		masks.input = (i_ & 1) ? 0 : GPIO_ALL_MASK;
+		set_masks(hw, &masks);
+	});
+	BENCH("get_status", n, { get_status(hw, &status); sink = status.level; });
+	BENCH("bus_write, 8 pins on 2 banks", n, bus_write(hw, bus, i_ & 0xff));
+	BENCH("bus_read, 8 pins on 2 banks", n, sink = bus_read(hw, bus));
+	(void)sink;
+	logging = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct test_gpio_regs hw;
+	static struct test_gpio_bus bus;
+	long n = argc > 1 ? atol(argv[1]) : 1000000;
+
+	if (n <= 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		exit(1);
+	}
+
+	hw.base = sim_regs;
+	regs_init(&hw);
+
+	test_writes(&hw);
+	test_bus(&hw, &bus);
+	if (failures) {
+		fprintf(stderr, "register write check FAILED (%d)\n", failures);
+		exit(1);
+	}
+	printf("register write check OK\n");
+
+	bench(&hw, &bus, n);
+	return 0;
+}
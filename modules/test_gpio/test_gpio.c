@@ -12,286 +12,1472 @@
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/sysfs.h>
-
-#define NUM_GPIOS 54
+#include <linux/mm.h>
+#include <linux/interrupt.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/vmalloc.h>
+#include <linux/ctype.h>
+#include "test_gpio_ioctl.h"
+#define CREATE_TRACE_POINTS
+#include "test_gpio_trace.h"
+#include "test_gpio_regs.h"
+
+#define NUM_PWM_CHANNELS	8
+#define PATTERN_MAX_STEPS	65536
+/* Shortest step / PWM phase, so a looping pattern cannot keep the CPU in the timer interrupt */
+#define MIN_DELAY_NS		1000
 
 /* Module parameters */
 static int gpio[NUM_GPIOS];
 static int gpio_argc = 0;
 module_param_array(gpio, int, &gpio_argc, 0644);
+static int events_size = 1024;
+MODULE_PARM_DESC(events_size, "Number of edge events buffered per device, rounded up to power of two");
+module_param(events_size, int, 0444);
+static int capture_size = 16384;
+MODULE_PARM_DESC(capture_size, "Number of run-length records in the capture buffer, 0 disables capture");
+module_param(capture_size, int, 0444);
+#define MAX_BUSES	8
+static char *bus[MAX_BUSES];
+static int bus_argc = 0;
+MODULE_PARM_DESC(bus, "Named pin groups read and written as one integer: name:pin0:pin1:... (pin0 is bit 0, up to 32 pins)");
+module_param_array(bus, charp, &bus_argc, 0444);
 
-/* GPIO register offsets */
-
-/* there are 5 GPFSEL 32bit registers, starting from offset 0x00.
- * Every register controls 10 pins, 3 bits per pin, so the last two bits are unused (reserved).
- * 000 - GPIO pin is input
- * 001 - GPIO pin is otput
- * xxx - for other combinations, GPIO pin takes some alternate function */
-#define GPFSEL		0x0		/* Function Select */
-
-/* there are 2 GPSET 32bit registers, starting from offset 0x1c.
- * Every register controls 32 pins, 1 bit per pin.
- * 0 - no effect
- * 1 - Set GPIO pin */
-#define GPSET		0x1c	/* Pin Output Set */
-
-/* there are 2 GPCLR 32bit registers, starting from offset 0x28.
- * Every register controls 32 pins, 1 bit per pin.
- * 0 - no effect
- * 1 - Clear GPIO pin */
-#define GPCLR		0x28	/* Pin Output Clear */
-
-/* there are 2 GPCLR 32bit registers, starting from offset 0x34.
- * Every register controls 32 pins, 1 bit per pin.
- * 0 - GPIO pin is low
- * 1 - GPIO pin is high */
-#define GPLEV		0x34	/* Pin Level */
-
-#define GET_GPFSEL_REG_OFFSET(pin)		(GPFSEL + (((pin) / 10) * 4))
-#define GET_GPSET_REG_OFFSET(pin)		(GPSET + (((pin) / 32) * 4))
-#define GET_GPCLR_REG_OFFSET(pin)		(GPCLR + (((pin) / 32) * 4))
-#define GET_GPLEV_REG_OFFSET(pin)		(GPLEV + (((pin) / 32) * 4))
-
-#define GET_GPFSEL_PIN_OFFSET(pin)		(((pin) % 10) * 3)
-#define GET_GPSET_PIN_OFFSET(pin)		(pin)
-#define GET_GPCLR_PIN_OFFSET(pin)		(pin)
-#define GET_GPLEV_PIN_OFFSET(pin)		(pin)
-
-
-enum output_level {
-	OUTPUT_LOW,
-	OUTPUT_HIGH,
-	OUTPUT_MAX
+struct test_gpio_dev {
+	/* miscdev struct is used to handle multiple devices */
+	struct miscdevice miscdev;
+	/* register block and GPFSEL shadow, see test_gpio_regs.h */
+	struct test_gpio_regs hw;
+	phys_addr_t phys;	/* physical address of the register block, used by mmap() */
+	/* sysfs: one testgpioN group per exported pin and one per bus, groups is NULL terminated array for sysfs_create_groups() */
+	struct test_gpio_pin_sysfs *pin_sysfs;
+	const struct attribute_group **groups;
+
+	/* Edge capture.
+	 * Events are written by the IRQ threads and read by read(). Both sides only move their own index
+	 * (ev_head / ev_tail) with release semantics, so the reader never blocks the IRQ thread.
+	 * ev_lock only serializes the two bank threads against each other, ev_read_lock serializes readers.
+	 * edge_lock serializes TEST_GPIO_IOCTL_SET_EDGES, the hard IRQ handler reads edge_mask without it. */
+	spinlock_t edge_lock;
+	struct test_gpio_bank {
+		struct test_gpio_dev *dev;
+		int bank;
+		int irq;		/* -1 when edge capture is not available */
+		u32 edge_mask;	/* pins of this bank captured by this driver */
+		/* latched by the hard IRQ handler, consumed by the IRQ thread (IRQF_ONESHOT keeps them apart) */
+		u32 eds;
+		u32 lev;
+		u64 timestamp;
+	} banks[2];
+	struct test_gpio_event *events;
+	unsigned int ev_size;
+	unsigned int ev_head;
+	unsigned int ev_tail;
+	u64 ev_dropped;
+	spinlock_t ev_lock;
+	struct mutex ev_read_lock;
+	wait_queue_head_t ev_wait;
+
+	/* Waveform engine. Pattern and PWM channels are played from hrtimer callbacks,
+	 * which only write GPSET/GPCLR. pattern_lock serializes (re)configuration from ioctl.
+	 * waveform_dead is set under it by remove(), so files still open cannot start a timer after that. */
+	struct mutex pattern_lock;
+	bool waveform_dead;
+	struct hrtimer pattern_timer;
+	struct test_gpio_step *pattern;
+	unsigned int pattern_count;
+	unsigned int pattern_pos;
+	bool pattern_loop;
+	struct test_gpio_pwm_chan {
+		struct test_gpio_dev *dev;
+		struct hrtimer timer;
+		int pin;		/* -1 when channel is free */
+		u64 period_ns;
+		u64 duty_ns;
+		bool high;
+	} pwm[NUM_PWM_CHANNELS];
+	spinlock_t timing_lock;
+	struct test_gpio_timing_stats timing;
+
+	/* Logic analyzer capture. The hrtimer callback is the only writer of the buffer: it extends the open record
+	 * at cap_records, or completes it (cap_records++, with release) when levels change. read() and mmap() users
+	 * look only at complete records. capture_lock serializes start/stop from ioctl. */
+	struct mutex capture_lock;
+	struct hrtimer cap_timer;
+	struct test_gpio_sample *capture;	/* vmalloc_user(), so it can be mapped */
+	unsigned int cap_size;
+	unsigned int cap_records;
+	bool cap_open;		/* record at cap_records is in use */
+	bool cap_running;
+	bool cap_overflow;
+	u64 cap_mask;
+	u64 cap_period_ns;
+	u64 cap_limit;
+	u64 cap_samples;
+	u64 cap_missed;
+	u64 cap_start_ns;
+	wait_queue_head_t cap_wait;
 };
 
-enum reg_fsel {
-	REG_FSEL_GPIO_IN = 0,
-	REG_FSEL_GPIO_OUT = 1,
-	REG_FSEL_ALT0 = 4,
-	REG_FSEL_ALT1 = 5,
-	REG_FSEL_ALT2 = 6,
-	REG_FSEL_ALT3 = 7,
-	REG_FSEL_ALT4 = 3,
-	REG_FSEL_ALT5 = 2
+/* sysfs attribute which knows its pin, so show()/store() need no parsing of the file name */
+struct test_gpio_attr {
+	struct device_attribute attr;
+	int pin;
+};
+#define to_test_gpio_attr(a)	container_of(a, struct test_gpio_attr, attr)
+
+/* testgpioN directory with value and direction files */
+struct test_gpio_pin_sysfs {
+	char name[12];
+	struct test_gpio_attr value;
+	struct test_gpio_attr direction;
+	struct attribute *attrs[3];
+	struct attribute_group group;
 };
 
-struct test_gpio_dev {
-	/* miscdev struct is used to handle multiple devices */
-	struct miscdevice miscdev;
-	void __iomem *regs;
-	struct device_attribute **dev_attr;
-	char **sysfiles;
+/* Bus directory (named by the "bus" module parameter) with value, direction and pins files */
+struct test_gpio_bus_sysfs {
+	char name[16];
+	int pins[BUS_MAX_PINS];
+	int npins;
+	struct test_gpio_bus bus;	/* lookup tables, see test_gpio_regs.h */
+	struct device_attribute value;
+	struct device_attribute direction;
+	struct device_attribute pins_attr;
+	struct attribute *attrs[4];
+	struct attribute_group group;
+};
+
+/* Status text is at most "GPIO:\n" plus one "  NN output: L\n" line per pin */
+#define STATUS_TEXT_SIZE	1024
+
+/* Shift engine state of an open file, built by TEST_GPIO_IOCTL_SHIFT_SETUP.
+ * For every byte value and clock step, the GPCLR and GPSET values of the data phase are precomputed
+ * (clock going idle included), so the transfer loop only looks them up and writes registers. */
+struct test_gpio_shifter {
+	struct test_gpio_shift_setup setup;
+	unsigned int steps;		/* clocks per byte, 8 / width */
+	int set_off;			/* GPSET, GPCLR and GPLEV of the bank holding all pins */
+	int clr_off;
+	int lev_off;
+	int active_off;			/* clock to active level: GPSET, or GPCLR with TEST_GPIO_SHIFT_CPOL */
+	int idle_off;
+	u32 clock;				/* clock (pulse mode: data) pin bit in the bank registers */
+	u8 group_shift[8];		/* bit position of the group sent at each step */
+	u8 in_bit[8];
+	/* delays as shift_spin() loop counts, see shift_calibrate() */
+	u32 setup_loops;
+	u32 active_loops;
+	u32 high_loops[2];		/* pulse mode, by bit value */
+	u32 low_loops[2];
+	u64 max_bit_ns;			/* pulse mode, longer of the two bit times */
+	u32 set[256][8];
+	u32 clr[256][8];
+	u8 buf[TEST_GPIO_SHIFT_MAX_LEN];
 };
 
+/* Per-open context, kept in file->private_data */
+struct test_gpio_file {
+	struct test_gpio_dev *dev;
+	int read_mode;	/* TEST_GPIO_READ_* */
+	int write_mode;	/* TEST_GPIO_WRITE_TEXT or TEST_GPIO_WRITE_BINARY */
+	size_t text_len;
+	char text[STATUS_TEXT_SIZE];
+	/* shift_lock keeps the shifter from being replaced during a transfer */
+	struct mutex shift_lock;
+	struct test_gpio_shifter *shift;
+};
+
+static int test_gpio_open(struct inode *inode, struct file *file);
+static int test_gpio_release(struct inode *inode, struct file *file);
 static ssize_t test_gpio_write(struct file *file, const char __user *buf, size_t count, loff_t * ppos);
 static ssize_t test_gpio_read(struct file *file, char __user *buf, size_t count, loff_t * ppos);
+static long test_gpio_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static int test_gpio_mmap(struct file *file, struct vm_area_struct *vma);
+static unsigned int test_gpio_poll(struct file *file, poll_table *wait);
 
 static const struct file_operations test_gpio_fops = {
     .owner      = THIS_MODULE,
+	.open       = test_gpio_open,
+	.release    = test_gpio_release,
+	.llseek     = default_llseek,
     .write      = test_gpio_write,
-	.read       = test_gpio_read
+	.read       = test_gpio_read,
+	.unlocked_ioctl = test_gpio_ioctl,
+	.mmap       = test_gpio_mmap,
+	.poll       = test_gpio_poll
 };
 
-static unsigned int reg_read(struct test_gpio_dev *dev, int off)
+/* Register access backend of test_gpio_regs.h: the ioremap()-ed register block */
+static inline u32 reg_read(struct test_gpio_regs *hw, int off)
+{
+	return readl(hw->base + off);
+}
+
+static inline void reg_write(struct test_gpio_regs *hw, u32 val, int off)
+{
+	writel(val, hw->base + off);
+}
+
+/* Without the barrier against normal memory writes. Accesses to the register block still stay in order,
+ * so this is used in loops which only touch registers. */
+static inline void reg_write_relaxed(struct test_gpio_regs *hw, u32 val, int off)
+{
+	writel_relaxed(val, hw->base + off);
+}
+
+static int test_gpio_open(struct inode *inode, struct file *file)
 {
-	return readl(dev->regs + off);
+	/* The ﬁrst thing to do is to retrieve the test_gpio_dev structure from the miscdevice structure itself,
+	 * accessible through the private_data ﬁeld of the open ﬁle structure (file), as set by the misc framework.
+	 * At the time we registered our misc device, we didn’t keep any pointer to the test_gpio_dev structure.
+	 * However, as the miscdevice structure is accessible through file->private_data, and is a member of the test_gpio_dev structure,
+	 * we can use a magic macro to compute the address of the parent structure:
+	 *
+	 * see: http://radek.io/2012/11/10/magical-container_of-macro/
+	 *
+	 * private_data is then replaced with our per-open context, which keeps the pointer to the test_gpio_dev.
+	 */
+	struct test_gpio_dev *dev = container_of(file->private_data, struct test_gpio_dev, miscdev);
+	struct test_gpio_file *priv;
+
+	priv = kzalloc(sizeof(*priv), GFP_KERNEL);
+	if (priv == NULL)
+		return -ENOMEM;
+
+	priv->dev = dev;
+	priv->read_mode = TEST_GPIO_READ_TEXT;
+	priv->write_mode = TEST_GPIO_WRITE_TEXT;
+	mutex_init(&priv->shift_lock);
+	file->private_data = priv;
+
+	return 0;
 }
 
-static void reg_write(struct test_gpio_dev *dev, int val, int off)
+static int test_gpio_release(struct inode *inode, struct file *file)
 {
-	writel(val, dev->regs + off);
-	return;
+	struct test_gpio_file *priv = file->private_data;
+
+	vfree(priv->shift);
+	kfree(priv);
+	return 0;
 }
 
+static inline struct test_gpio_dev *file_to_dev(struct file *file)
+{
+	return ((struct test_gpio_file *)file->private_data)->dev;
+}
 
-static int set_output(struct test_gpio_dev *dev, char pin, enum output_level out) {
-//	int offset,
-	int val, mask;
-	int reg_offset, pin_offset;
+static size_t format_status(const struct test_gpio_status *status, char *buf, size_t size)
+{
+	size_t len;
+	int pin, val, level;
 
-	/* RED LED is connected to GPIO17, e.g. to turn it on: */
-	// GPFSEL1, bits 23-21 -> 001 = GPIO Pin 17 is an output
-	// GPSET0, set pin 17
-	/* GREEN LED is connected to GPIO26 */
+	len = scnprintf(buf, size, "GPIO:\n");
+	for (pin = 0; pin < NUM_GPIOS; pin++) {
+		val = (status->fsel[pin / 10] >> GET_GPFSEL_PIN_OFFSET(pin)) & 7;
+		level = (status->level >> pin) & 1;
+		if (val == REG_FSEL_GPIO_IN)
+			len += scnprintf(buf + len, size - len, "  %d input: %d\n", pin, level);
+		else if (val == REG_FSEL_GPIO_OUT)
+			len += scnprintf(buf + len, size - len, "  %d output: %d\n", pin, level);
+	}
 
-	reg_offset = GET_GPFSEL_REG_OFFSET(pin);
-	pin_offset = GET_GPFSEL_PIN_OFFSET(pin);
-	/* set pin as output */
-	// first, cleanup all 3 pin bits
-	mask = (0x03 << pin_offset);
-	val = reg_read(dev, reg_offset) & ~mask;
-	// then set pin as output
-	mask = (0x01 << pin_offset);
-	val |= mask;
-	reg_write(dev, val, reg_offset);
+	return len;
+}
 
-	/* set pin to 0 on 1 */
-	switch (out) {
-	case OUTPUT_LOW:
-		reg_offset = GET_GPCLR_REG_OFFSET(pin);
-		pin_offset = GET_GPCLR_PIN_OFFSET(pin);
-		val = (0x1 << pin_offset);
-		break;
+/******************************************************************************
+ *
+ * Edge capture
+ *
+ *****************************************************************************/
 
-	case OUTPUT_HIGH:
-		reg_offset = GET_GPSET_REG_OFFSET(pin);
-		pin_offset = GET_GPSET_PIN_OFFSET(pin);
-		val = (0x1 << pin_offset);
-		break;
+/* Only bits of pins captured before or after this call are changed in GPREN/GPFEN, other pins may belong to
+ * the built-in GPIO driver. Its read-modify-writes of the same registers are under its own lock, which is not
+ * available here, so concurrent edge configuration by both drivers can still lose an update. Pins being added or removed stay in edge_mask while their detection is reconfigured,
+ * so the hard IRQ handler acknowledges whatever they latch meanwhile. */
+static int set_edges(struct test_gpio_dev *dev, const struct test_gpio_edges *edges)
+{
+	struct test_gpio_bank *b;
+	u64 mask = edges->rising | edges->falling;
+	u32 old, new, changed, v;
+	int bank;
 
-	default:
-		printk(KERN_ALERT "\n[%s][%d] ERROR: Invalid argument!\n", __FUNCTION__, __LINE__);
+	if (mask & ~GPIO_ALL_MASK)
+		return -EINVAL;
+	for (bank = 0; bank < 2; bank++) {
+		if ((u32)(mask >> (bank * 32)) && dev->banks[bank].irq <= 0)
+			return -ENODEV;
 	}
 
-	reg_write(dev, val, reg_offset);
+	spin_lock(&dev->edge_lock);
+	for (bank = 0; bank < 2; bank++) {
+		b = &dev->banks[bank];
+		old = b->edge_mask;
+		new = (u32)(mask >> (bank * 32));
+		changed = old | new;
+		if (!changed)
+			continue;
+
+		WRITE_ONCE(b->edge_mask, changed);
+		v = reg_read(&dev->hw, GPREN + bank * 4) & ~changed;
+		reg_write(&dev->hw, v | (u32)(edges->rising >> (bank * 32)), GPREN + bank * 4);
+		v = reg_read(&dev->hw, GPFEN + bank * 4) & ~changed;
+		reg_write(&dev->hw, v | (u32)(edges->falling >> (bank * 32)), GPFEN + bank * 4);
+		/* drop events detected before this configuration */
+		reg_write(&dev->hw, changed, GPEDS + bank * 4);
+		WRITE_ONCE(b->edge_mask, new);
+	}
+	spin_unlock(&dev->edge_lock);
 
 	return 0;
 }
 
-static int set_input(struct test_gpio_dev *dev, char pin) {
-	int val, mask;
-	int reg_offset, pin_offset;
+/* Hard IRQ handler only latches which pins fired, their levels and the time, so the timestamp is taken
+ * as close to the edge as possible. Expanding that into events is left to the IRQ thread. */
+static irqreturn_t test_gpio_irq(int irq, void *data)
+{
+	struct test_gpio_bank *b = data;
+	struct test_gpio_dev *dev = b->dev;
+	u32 eds;
+
+	eds = reg_read(&dev->hw, GPEDS + b->bank * 4) & READ_ONCE(b->edge_mask);
+	if (!eds)
+		return IRQ_NONE;
+
+	b->timestamp = ktime_get_ns();
+	b->lev = reg_read(&dev->hw, GPLEV + b->bank * 4);
+	b->eds = eds;
+	reg_write(&dev->hw, eds, GPEDS + b->bank * 4);
+
+	return IRQ_WAKE_THREAD;
+}
+
+static irqreturn_t test_gpio_irq_thread(int irq, void *data)
+{
+	struct test_gpio_bank *b = data;
+	struct test_gpio_dev *dev = b->dev;
+	struct test_gpio_event *ev;
+	unsigned int head, tail;
+	u32 eds = b->eds;
+	int bit;
+
+	spin_lock(&dev->ev_lock);
+	head = dev->ev_head;
+	tail = smp_load_acquire(&dev->ev_tail);
+	while (eds) {
+		bit = __ffs(eds);
+		eds &= ~BIT(bit);
+
+		if (head - tail >= dev->ev_size) {
+			dev->ev_dropped++;
+			continue;
+		}
+		ev = &dev->events[head & (dev->ev_size - 1)];
+		ev->timestamp = b->timestamp;
+		ev->pin = b->bank * 32 + bit;
+		ev->level = (b->lev >> bit) & 1;
+		head++;
+	}
+	smp_store_release(&dev->ev_head, head);
+	spin_unlock(&dev->ev_lock);
+
+	wake_up_interruptible(&dev->ev_wait);
+	return IRQ_HANDLED;
+}
+
+static inline unsigned int events_queued(struct test_gpio_dev *dev)
+{
+	return smp_load_acquire(&dev->ev_head) - dev->ev_tail;
+}
+
+/* Copy as many whole events as fit into the user buffer. Blocks while the ring is empty, unless O_NONBLOCK */
+static ssize_t read_events(struct test_gpio_dev *dev, struct file *file, char __user *buf, size_t count)
+{
+	unsigned int n, tail, idx, chunk;
+	ssize_t ret;
+
+	if (count < sizeof(struct test_gpio_event))
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&dev->ev_read_lock))
+		return -ERESTARTSYS;
+
+	while ((n = events_queued(dev)) == 0) {
+		mutex_unlock(&dev->ev_read_lock);
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(dev->ev_wait, events_queued(dev) != 0))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&dev->ev_read_lock))
+			return -ERESTARTSYS;
+	}
+
+	n = min_t(size_t, n, count / sizeof(struct test_gpio_event));
+	tail = dev->ev_tail;
+	idx = tail & (dev->ev_size - 1);
+	/* ring may wrap, copy in up to two pieces */
+	chunk = min(n, dev->ev_size - idx);
+	if (copy_to_user(buf, &dev->events[idx], chunk * sizeof(struct test_gpio_event)) ||
+	    copy_to_user(buf + chunk * sizeof(struct test_gpio_event), dev->events, (n - chunk) * sizeof(struct test_gpio_event))) {
+		ret = -EFAULT;
+		goto out;
+	}
+	smp_store_release(&dev->ev_tail, tail + n);
+	ret = n * sizeof(struct test_gpio_event);
+
+out:
+	mutex_unlock(&dev->ev_read_lock);
+	return ret;
+}
+
+static unsigned int test_gpio_poll(struct file *file, poll_table *wait)
+{
+	struct test_gpio_file *priv = file->private_data;
+	struct test_gpio_dev *dev = priv->dev;
+
+	if (priv->read_mode == TEST_GPIO_READ_CAPTURE) {
+		poll_wait(file, &dev->cap_wait, wait);
+		if ((loff_t)smp_load_acquire(&dev->cap_records) * sizeof(struct test_gpio_sample) > file->f_pos ||
+		    !READ_ONCE(dev->cap_running))
+			return POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM;
+		return POLLOUT | POLLWRNORM;
+	}
+
+	/* status reads never block */
+	if (priv->read_mode != TEST_GPIO_READ_EVENTS)
+		return POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM;
+
+	poll_wait(file, &dev->ev_wait, wait);
+	if (events_queued(dev))
+		return POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM;
+	return POLLOUT | POLLWRNORM;
+}
+
+/******************************************************************************
+ *
+ * Waveform engine: pattern playback and software PWM
+ *
+ *****************************************************************************/
+
+/* Account how late a timer callback fired against its programmed expiry */
+static void timing_account(struct test_gpio_dev *dev, struct hrtimer *timer)
+{
+	s64 late = ktime_to_ns(ktime_sub(ktime_get(), hrtimer_get_expires(timer)));
+	unsigned long flags;
+
+	if (late < 0)
+		late = 0;
+
+	spin_lock_irqsave(&dev->timing_lock, flags);
+	dev->timing.edges++;
+	dev->timing.late_total_ns += late;
+	if (late > dev->timing.late_max_ns)
+		dev->timing.late_max_ns = late;
+	dev->timing.late_hist[min_t(int, fls64(late), TEST_GPIO_LATE_HIST_SIZE - 1)]++;
+	spin_unlock_irqrestore(&dev->timing_lock, flags);
+}
+
+static enum hrtimer_restart pattern_timer_fn(struct hrtimer *timer)
+{
+	struct test_gpio_dev *dev = container_of(timer, struct test_gpio_dev, pattern_timer);
+	const struct test_gpio_step *step = &dev->pattern[dev->pattern_pos];
+
+	write_levels(&dev->hw, step->set, step->clear);
+	timing_account(dev, timer);
+
+	if (++dev->pattern_pos == dev->pattern_count) {
+		if (!dev->pattern_loop)
+			return HRTIMER_NORESTART;
+		dev->pattern_pos = 0;
+	}
+
+	/* next step is scheduled from the previous expiry, not from now, so lateness does not accumulate */
+	hrtimer_add_expires_ns(timer, step->delay_ns);
+	return HRTIMER_RESTART;
+}
+
+static enum hrtimer_restart pwm_timer_fn(struct hrtimer *timer)
+{
+	struct test_gpio_pwm_chan *ch = container_of(timer, struct test_gpio_pwm_chan, timer);
+	u64 bit = BIT_ULL(ch->pin);
+
+	ch->high = !ch->high;
+	if (ch->high)
+		write_levels(&ch->dev->hw, bit, 0);
+	else
+		write_levels(&ch->dev->hw, 0, bit);
+	timing_account(ch->dev, timer);
+
+	hrtimer_add_expires_ns(timer, ch->high ? ch->duty_ns : ch->period_ns - ch->duty_ns);
+	return HRTIMER_RESTART;
+}
+
+static void pattern_stop(struct test_gpio_dev *dev)
+{
+	hrtimer_cancel(&dev->pattern_timer);
+}
+
+/* Copy steps from userspace, replacing the previous pattern. Playback is stopped. */
+static int pattern_load(struct test_gpio_dev *dev, const struct test_gpio_pattern *p)
+{
+	struct test_gpio_step *steps;
+	unsigned int i;
 
-	/* e.g, Switch is connected to GPIO17, e.g. to set it as input: */
-	// GPFSEL1, bits 23-21 -> 000 = GPIO Pin 17 is an output
+	if (dev->waveform_dead)
+		return -ENODEV;
+	if (p->count == 0 || p->count > PATTERN_MAX_STEPS || (p->flags & ~TEST_GPIO_PATTERN_LOOP))
+		return -EINVAL;
 
-	reg_offset = GET_GPFSEL_REG_OFFSET(pin);
-	pin_offset = GET_GPFSEL_PIN_OFFSET(pin);
-	mask = (0x03 << pin_offset);
-	val = reg_read(dev, reg_offset) & ~mask;
-	reg_write(dev, val, reg_offset);
+	steps = vmalloc(p->count * sizeof(*steps));
+	if (steps == NULL)
+		return -ENOMEM;
+	if (copy_from_user(steps, u64_to_user_ptr(p->steps), p->count * sizeof(*steps))) {
+		vfree(steps);
+		return -EFAULT;
+	}
+	for (i = 0; i < p->count; i++) {
+		if (((steps[i].set | steps[i].clear) & ~GPIO_ALL_MASK) || (steps[i].set & steps[i].clear) ||
+		    steps[i].delay_ns < MIN_DELAY_NS) {
+			vfree(steps);
+			return -EINVAL;
+		}
+	}
+
+	pattern_stop(dev);
+	vfree(dev->pattern);
+	dev->pattern = steps;
+	dev->pattern_count = p->count;
+	dev->pattern_loop = !!(p->flags & TEST_GPIO_PATTERN_LOOP);
 
 	return 0;
 }
 
-static ssize_t test_gpio_read(struct file *file, char __user *buf, size_t count, loff_t * ppos)
+static int pattern_start(struct test_gpio_dev *dev)
 {
-	struct test_gpio_dev *dev = container_of(file->private_data, struct test_gpio_dev, miscdev);
-	static int pin = -1;
-	int i, val, level;
-	char tmp_buf[200] = {0};
-	int transfer_size;
-	int reg_offset, pin_offset;
-
-//	printk(KERN_ALERT "\n----- [%s] [%d] ENTER!!!!, *ppos: %llu\n", __FUNCTION__, __LINE__, *ppos);
-
-	if (pin == -1) {
-		snprintf(tmp_buf, sizeof(tmp_buf), "\nGPIO:");
-		pin++;
-		goto transfer;
-	}
-	for (i = pin ; i < NUM_GPIOS; i++) {
-		reg_offset = GET_GPFSEL_REG_OFFSET(pin);
-		pin_offset = GET_GPFSEL_PIN_OFFSET(pin);
-
-		val = reg_read(dev, reg_offset);
-		val = (val >> pin_offset) & 7;
-
-		if (val == REG_FSEL_GPIO_IN || val == REG_FSEL_GPIO_OUT) {
-			reg_offset = GET_GPLEV_REG_OFFSET(pin);
-			pin_offset = GET_GPLEV_PIN_OFFSET(pin);
-			level = reg_read(dev, reg_offset);
-			level = (level >> pin_offset) & 1;
-			if (val == REG_FSEL_GPIO_IN)
-				snprintf(tmp_buf, sizeof(tmp_buf), "\n  %d input: %d", i, level);
-			else
-				snprintf(tmp_buf, sizeof(tmp_buf), "\n  %d output: %d", i, level);
+	struct test_gpio_masks masks = { 0 };
+	unsigned int i;
+
+	if (dev->waveform_dead)
+		return -ENODEV;
+	if (dev->pattern == NULL)
+		return -EINVAL;
+
+	pattern_stop(dev);
+	/* every pin touched by the pattern becomes an output */
+	for (i = 0; i < dev->pattern_count; i++)
+		masks.output |= dev->pattern[i].set | dev->pattern[i].clear;
+	set_masks(&dev->hw, &masks);
+
+	spin_lock_irq(&dev->timing_lock);
+	memset(&dev->timing, 0, sizeof(dev->timing));
+	spin_unlock_irq(&dev->timing_lock);
+
+	dev->pattern_pos = 0;
+	hrtimer_start(&dev->pattern_timer, ktime_get(), HRTIMER_MODE_ABS);
+
+	return 0;
+}
+
+/* Start, change or stop (period 0) software PWM on one pin.
+ * Duty 0 or duty equal to period leaves the pin statically low or high, without a timer. */
+static int pwm_set(struct test_gpio_dev *dev, const struct test_gpio_pwm *pwm)
+{
+	struct test_gpio_pwm_chan *ch = NULL;
+	struct test_gpio_masks masks = { 0 };
+	int i;
+
+	if (dev->waveform_dead)
+		return -ENODEV;
+	if (pwm->pin >= NUM_GPIOS || pwm->duty_ns > pwm->period_ns)
+		return -EINVAL;
+	if (pwm->duty_ns && pwm->duty_ns < pwm->period_ns &&
+	    (pwm->duty_ns < MIN_DELAY_NS || pwm->period_ns - pwm->duty_ns < MIN_DELAY_NS))
+		return -EINVAL;
+
+	for (i = 0; i < NUM_PWM_CHANNELS; i++) {
+		if (dev->pwm[i].pin == pwm->pin) {
+			ch = &dev->pwm[i];
+			break;
 		}
-			pin++;
-			goto transfer;
+		if (ch == NULL && dev->pwm[i].pin < 0)
+			ch = &dev->pwm[i];
+	}
+	if (ch == NULL)
+		return -EBUSY;
+
+	hrtimer_cancel(&ch->timer);
+	if (pwm->period_ns == 0) {
+		ch->pin = -1;
+		return 0;
+	}
+
+	ch->pin = pwm->pin;
+	ch->period_ns = pwm->period_ns;
+	ch->duty_ns = pwm->duty_ns;
+
+	masks.output = BIT_ULL(ch->pin);
+	if (ch->duty_ns == 0 || ch->duty_ns == ch->period_ns) {
+		if (ch->duty_ns)
+			masks.set = BIT_ULL(ch->pin);
+		else
+			masks.clear = BIT_ULL(ch->pin);
+		return set_masks(&dev->hw, &masks);
 	}
 
-	pin = -1;
+	/* first callback drives the pin high */
+	masks.clear = BIT_ULL(ch->pin);
+	set_masks(&dev->hw, &masks);
+	ch->high = false;
+	hrtimer_start(&ch->timer, ktime_get(), HRTIMER_MODE_ABS);
+
 	return 0;
+}
+
+static void waveform_init(struct test_gpio_dev *dev)
+{
+	int i;
+
+	mutex_init(&dev->pattern_lock);
+	spin_lock_init(&dev->timing_lock);
+	hrtimer_init(&dev->pattern_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	dev->pattern_timer.function = pattern_timer_fn;
+	for (i = 0; i < NUM_PWM_CHANNELS; i++) {
+		dev->pwm[i].dev = dev;
+		dev->pwm[i].pin = -1;
+		hrtimer_init(&dev->pwm[i].timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+		dev->pwm[i].timer.function = pwm_timer_fn;
+	}
+}
+
+static void waveform_exit(struct test_gpio_dev *dev)
+{
+	int i;
+
+	mutex_lock(&dev->pattern_lock);
+	dev->waveform_dead = true;
+	pattern_stop(dev);
+	for (i = 0; i < NUM_PWM_CHANNELS; i++)
+		hrtimer_cancel(&dev->pwm[i].timer);
+	vfree(dev->pattern);
+	dev->pattern = NULL;
+	mutex_unlock(&dev->pattern_lock);
+}
 
-transfer:
-	transfer_size = strlen(tmp_buf) + 1;
+/******************************************************************************
+ *
+ * Logic analyzer capture
+ *
+ *****************************************************************************/
+
+/* Add n periods with levels lev to the open record, or open a new one. Returns false when the buffer is full. */
+static bool capture_add(struct test_gpio_dev *dev, u64 lev, u32 n)
+{
+	struct test_gpio_sample *s = &dev->capture[dev->cap_records];
+
+	if (dev->cap_open) {
+		if (s->levels == lev && s->count <= U32_MAX - n) {
+			s->count += n;
+			return true;
+		}
+		if (dev->cap_records + 1 == dev->cap_size)
+			return false;
+		/* record is complete, readers may copy it from now on */
+		smp_store_release(&dev->cap_records, dev->cap_records + 1);
+		if (wq_has_sleeper(&dev->cap_wait))
+			wake_up_interruptible(&dev->cap_wait);
+		s++;
+	}
+
+	s->levels = lev;
+	s->count = n;
+	dev->cap_open = true;
+	return true;
+}
 
-	//		printk(KERN_ALERT "\n----- [%s] [%d] tmp_buf: %s \n", __FUNCTION__, __LINE__, tmp_buf);
-	if (copy_to_user(buf /* to */ , tmp_buf + *ppos/* from */ , transfer_size)) {
-		printk(KERN_ERR "ERROR, copy_to_user return -EFAULT \n");
+/* Complete the open record and wake readers, called when the timer is not running anymore */
+static void capture_finish(struct test_gpio_dev *dev)
+{
+	if (dev->cap_open) {
+		smp_store_release(&dev->cap_records, dev->cap_records + 1);
+		dev->cap_open = false;
+	}
+	WRITE_ONCE(dev->cap_running, false);
+	wake_up_interruptible(&dev->cap_wait);
+}
+
+static enum hrtimer_restart capture_timer_fn(struct hrtimer *timer)
+{
+	struct test_gpio_dev *dev = container_of(timer, struct test_gpio_dev, cap_timer);
+	u64 lev = 0, overruns;
+
+	/* only the banks holding recorded pins are read */
+	if ((u32)dev->cap_mask)
+		lev = reg_read(&dev->hw, GPLEV);
+	if ((u32)(dev->cap_mask >> 32))
+		lev |= (u64)reg_read(&dev->hw, GPLEV + 4) << 32;
+	lev &= dev->cap_mask;
+
+	if (!capture_add(dev, lev, 1))
+		goto overflow;
+	if (++dev->cap_samples == dev->cap_limit)
+		goto done;
+
+	/* unlike the waveform timers, a late sampler skips the periods it missed instead of catching up */
+	overruns = hrtimer_forward_now(timer, ns_to_ktime(dev->cap_period_ns));
+	if (overruns > 1) {
+		dev->cap_missed += overruns - 1;
+		if (!capture_add(dev, lev, min_t(u64, overruns - 1, U32_MAX)))
+			goto overflow;
+	}
+	return HRTIMER_RESTART;
+
+overflow:
+	dev->cap_overflow = true;
+done:
+	capture_finish(dev);
+	return HRTIMER_NORESTART;
+}
+
+static void capture_stop(struct test_gpio_dev *dev)
+{
+	if (hrtimer_cancel(&dev->cap_timer) || READ_ONCE(dev->cap_running))
+		capture_finish(dev);
+}
+
+static int capture_start(struct test_gpio_dev *dev, const struct test_gpio_capture *c)
+{
+	ktime_t start;
+
+	if (dev->capture == NULL)
+		return -ENODEV;
+	if (c->period_ns < MIN_DELAY_NS || c->pin_mask == 0 || (c->pin_mask & ~GPIO_ALL_MASK))
+		return -EINVAL;
+
+	capture_stop(dev);
+	dev->cap_mask = c->pin_mask;
+	dev->cap_period_ns = c->period_ns;
+	dev->cap_limit = c->samples;
+	dev->cap_samples = 0;
+	dev->cap_missed = 0;
+	dev->cap_overflow = false;
+	dev->cap_open = false;
+	smp_store_release(&dev->cap_records, 0);
+	WRITE_ONCE(dev->cap_running, true);
+
+	start = ktime_get();
+	dev->cap_start_ns = ktime_to_ns(start);
+	hrtimer_start(&dev->cap_timer, start, HRTIMER_MODE_ABS);
+
+	return 0;
+}
+
+static void capture_status(struct test_gpio_dev *dev, struct test_gpio_capture_status *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->records = smp_load_acquire(&dev->cap_records);
+	st->running = READ_ONCE(dev->cap_running);
+	/* counters are written by the timer, they are exact once capture has stopped */
+	st->start_ns = dev->cap_start_ns;
+	st->period_ns = dev->cap_period_ns;
+	st->samples = READ_ONCE(dev->cap_samples);
+	st->missed = READ_ONCE(dev->cap_missed);
+	st->size = dev->cap_size;
+	st->overflow = READ_ONCE(dev->cap_overflow);
+}
+
+/* Complete records from the file position on, as many whole records as fit.
+ * Blocks while there is nothing new and capture runs (unless O_NONBLOCK), returns 0 at the end of a stopped capture.
+ * A new capture starts from record 0 again, the reader should seek back to 0. */
+static ssize_t read_capture(struct test_gpio_dev *dev, struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+	const size_t rec = sizeof(struct test_gpio_sample);
+	unsigned int first, avail;
+	size_t n;
+
+	if (dev->capture == NULL)
+		return -ENODEV;
+	if (count < rec || *ppos < 0)
+		return -EINVAL;
+	if (*ppos >= (loff_t)dev->cap_size * rec)
+		return 0;
+	/* position is below the buffer size here, so no 64-bit division is needed */
+	if ((unsigned long)*ppos % rec)
+		return -EINVAL;
+	first = (unsigned long)*ppos / rec;
+
+	while ((avail = smp_load_acquire(&dev->cap_records)) <= first) {
+		if (!READ_ONCE(dev->cap_running))
+			return 0;
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(dev->cap_wait,
+				smp_load_acquire(&dev->cap_records) > first || !READ_ONCE(dev->cap_running)))
+			return -ERESTARTSYS;
+	}
+
+	n = min_t(size_t, avail - first, count / rec);
+	if (copy_to_user(buf, &dev->capture[first], n * rec))
 		return -EFAULT;
+	*ppos += n * rec;
+	return n * rec;
+}
+
+/* devm action, runs after remove() or a failed probe, before the registers are unmapped.
+ * capture is cleared under capture_lock, so TEST_GPIO_IOCTL_CAPTURE_START from a file still open fails with ENODEV. */
+static void capture_exit(void *data)
+{
+	struct test_gpio_dev *dev = data;
+	struct test_gpio_sample *capture;
+
+	mutex_lock(&dev->capture_lock);
+	capture_stop(dev);
+	capture = dev->capture;
+	dev->capture = NULL;
+	mutex_unlock(&dev->capture_lock);
+	vfree(capture);
+}
+
+static int capture_init(struct platform_device *pdev, struct test_gpio_dev *dev)
+{
+	mutex_init(&dev->capture_lock);
+	init_waitqueue_head(&dev->cap_wait);
+	hrtimer_init(&dev->cap_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	dev->cap_timer.function = capture_timer_fn;
+
+	if (capture_size <= 0)
+		return 0;
+	if (capture_size > INT_MAX / sizeof(struct test_gpio_sample)) {
+		dev_err(&pdev->dev, "invalid capture_size %d\n", capture_size);
+		return -EINVAL;
 	}
-	return (transfer_size);
+	/* preallocated, so the timer callback never allocates */
+	dev->capture = vmalloc_user(capture_size * sizeof(struct test_gpio_sample));
+	if (dev->capture == NULL)
+		return -ENOMEM;
+	dev->cap_size = capture_size;
+
+	return devm_add_action_or_reset(&pdev->dev, capture_exit, dev);
 }
 
+/******************************************************************************
+ *
+ * Shift engine: bit-banged clocked (SPI like) and pulse width (WS2812 like) serial output
+ *
+ *****************************************************************************/
 
-static ssize_t test_gpio_write(struct file *file, const char __user *buf, size_t count, loff_t * ppos)
+#define SHIFT_FLAGS_ALL	(TEST_GPIO_SHIFT_LSB_FIRST | TEST_GPIO_SHIFT_CPOL | TEST_GPIO_SHIFT_PULSE)
+#define SHIFT_CALIBRATE_LOOPS	100000
+
+/* ndelay() on 32-bit ARM falls back to udelay(DIV_ROUND_UP(ns, 1000)), and the Pi's udelay() counts the 1 MHz
+ * system timer, so a 350 ns pulse would last at least 1 us. Shift delays are busy loops instead. */
+static noinline void shift_spin(u32 loops)
 {
-	/* The ﬁrst thing to do is to retrieve the test_gpio_dev structure from the miscdevice structure itself,
-	 * accessible through the private_data ﬁeld of the open ﬁle structure (file).
-	 * At the time we registered our misc device, we didn’t keep any pointer to the test_gpio_dev structure.
-	 * However, as the miscdevice structure is accessible through file->private_data, and is a member of the test_gpio_dev structure,
-	 * we can use a magic macro to compute the address of the parent structure:
-	 *
-	 * see: http://radek.io/2012/11/10/magical-container_of-macro/
-	 */
-	struct test_gpio_dev *dev = container_of(file->private_data, struct test_gpio_dev, miscdev);
-	int pass=0;
-	char *input, *input_free;
-	const char *tmp;
-	char cmd[20], pin;
-	int err;
+	while (loops--)
+		barrier();
+}
+
+/* shift_spin() loops per ns in 16.16 fixed point, measured against ktime once per TEST_GPIO_IOCTL_SHIFT_SETUP */
+static u64 shift_calibrate(void)
+{
+	unsigned long flags;
+	u64 start, ns;
 
-	printk(KERN_ALERT "\n----- [%s] [%d] ENTER!!!\n", __FUNCTION__, __LINE__);
+	local_irq_save(flags);
+	start = ktime_get_ns();
+	shift_spin(SHIFT_CALIBRATE_LOOPS);
+	ns = ktime_get_ns() - start;
+	local_irq_restore(flags);
 
-	input = kzalloc(count, GFP_ATOMIC);
-	input_free = input;
-	if (input == NULL) {
-		err = -ENOMEM;
-		goto out_err;
+	return div64_u64((u64)SHIFT_CALIBRATE_LOOPS << 16, max_t(u64, ns, 1));
+}
+
+static u32 shift_loops(u64 loops_per_ns, u32 ns)
+{
+	return min_t(u64, ((u64)ns * loops_per_ns) >> 16, U32_MAX);
+}
+
+static int shift_check(const struct test_gpio_shift_setup *su)
+{
+	u64 used = 0;
+	int pins[17], n = 0, i;
+
+	if (su->flags & ~SHIFT_FLAGS_ALL)
+		return -EINVAL;
+	if (su->width != 1 && su->width != 2 && su->width != 4 && su->width != 8)
+		return -EINVAL;
+	if (su->in_width && su->in_width != su->width)
+		return -EINVAL;
+	if ((su->flags & TEST_GPIO_SHIFT_PULSE) && (su->width != 1 || su->in_width))
+		return -EINVAL;
+
+	if (!(su->flags & TEST_GPIO_SHIFT_PULSE))
+		pins[n++] = su->clock_pin;
+	for (i = 0; i < su->width; i++)
+		pins[n++] = su->out_pins[i];
+	for (i = 0; i < su->in_width; i++)
+		pins[n++] = su->in_pins[i];
+
+	/* distinct pins, all in the bank of the first one, so every step is one GPCLR and one GPSET write */
+	for (i = 0; i < n; i++) {
+		if (pins[i] >= NUM_GPIOS || (used & BIT_ULL(pins[i])) || pins[i] / 32 != pins[0] / 32)
+			return -EINVAL;
+		used |= BIT_ULL(pins[i]);
 	}
 
-	/* Last character is 0xA (NL line feed). kzalloc initialize allicated memory to zeros.
-	 * Copy count-1 bytes only (without 0xA), last allocated byte in input buffer is NULL terminator */
-	if (copy_from_user(input, buf, count-1)) {
-		err = -EFAULT;
-		goto out_err;
+	return 0;
+}
+
+static void shift_build(struct test_gpio_shifter *sh)
+{
+	const struct test_gpio_shift_setup *su = &sh->setup;
+	bool cpol = su->flags & TEST_GPIO_SHIFT_CPOL;
+	int bank = su->out_pins[0] / 32;
+	unsigned int v, step, j, group;
+
+	sh->steps = 8 / su->width;
+	sh->set_off = GPSET + bank * 4;
+	sh->clr_off = GPCLR + bank * 4;
+	sh->lev_off = GPLEV + bank * 4;
+	sh->active_off = cpol ? sh->clr_off : sh->set_off;
+	sh->idle_off = cpol ? sh->set_off : sh->clr_off;
+	sh->clock = BIT((su->flags & TEST_GPIO_SHIFT_PULSE ? su->out_pins[0] : su->clock_pin) % 32);
+
+	for (step = 0; step < sh->steps; step++) {
+		group = su->flags & TEST_GPIO_SHIFT_LSB_FIRST ? step : sh->steps - 1 - step;
+		sh->group_shift[step] = group * su->width;
 	}
+	for (j = 0; j < su->in_width; j++)
+		sh->in_bit[j] = su->in_pins[j] % 32;
+
+	for (v = 0; v < 256; v++) {
+		for (step = 0; step < sh->steps; step++) {
+			sh->set[v][step] = 0;
+			sh->clr[v][step] = 0;
+			for (j = 0; j < su->width; j++) {
+				if ((v >> (sh->group_shift[step] + j)) & 1)
+					sh->set[v][step] |= BIT(su->out_pins[j] % 32);
+				else
+					sh->clr[v][step] |= BIT(su->out_pins[j] % 32);
+			}
+			if (cpol)
+				sh->set[v][step] |= sh->clock;
+			else
+				sh->clr[v][step] |= sh->clock;
+		}
+	}
+}
 
-	while ((tmp = strsep((char **)&input, " ")) != NULL) {
-		if (!*tmp) {
-			break;
+/* Build a new shifter and put its pins into their idle state: clock idle, data low, in_pins as inputs */
+static int shift_setup(struct test_gpio_dev *dev, struct test_gpio_file *priv, const struct test_gpio_shift_setup *su)
+{
+	struct test_gpio_shifter *sh;
+	struct test_gpio_masks masks = { 0 };
+	u64 loops_per_ns;
+	int err, j;
+
+	err = shift_check(su);
+	if (err)
+		return err;
+
+	sh = vmalloc(sizeof(*sh));
+	if (sh == NULL)
+		return -ENOMEM;
+	sh->setup = *su;
+	shift_build(sh);
+
+	loops_per_ns = shift_calibrate();
+	sh->setup_loops = shift_loops(loops_per_ns, su->setup_ns);
+	sh->active_loops = shift_loops(loops_per_ns, su->active_ns);
+	sh->high_loops[0] = shift_loops(loops_per_ns, su->t0h_ns);
+	sh->low_loops[0] = shift_loops(loops_per_ns, su->t0l_ns);
+	sh->high_loops[1] = shift_loops(loops_per_ns, su->t1h_ns);
+	sh->low_loops[1] = shift_loops(loops_per_ns, su->t1l_ns);
+	sh->max_bit_ns = max((u64)su->t0h_ns + su->t0l_ns, (u64)su->t1h_ns + su->t1l_ns);
+
+	for (j = 0; j < su->width; j++)
+		masks.clear |= BIT_ULL(su->out_pins[j]);
+	for (j = 0; j < su->in_width; j++)
+		masks.input |= BIT_ULL(su->in_pins[j]);
+	if (!(su->flags & TEST_GPIO_SHIFT_PULSE)) {
+		if (su->flags & TEST_GPIO_SHIFT_CPOL)
+			masks.set |= BIT_ULL(su->clock_pin);
+		else
+			masks.clear |= BIT_ULL(su->clock_pin);
+	}
+	masks.output = masks.set | masks.clear;
+	set_masks(&dev->hw, &masks);
+
+	mutex_lock(&priv->shift_lock);
+	vfree(priv->shift);
+	priv->shift = sh;
+	mutex_unlock(&priv->shift_lock);
+
+	return 0;
+}
+
+/* Every step: data phase (GPCLR, GPSET from the tables), setup delay, clock active, active delay, sample inputs */
+static void shift_clocked(struct test_gpio_dev *dev, struct test_gpio_shifter *sh, u32 len, bool rx)
+{
+	struct test_gpio_regs *hw = &dev->hw;
+	u32 setup_loops = sh->setup_loops, active_loops = sh->active_loops, lev;
+	unsigned int i, step, j;
+	u8 v, in;
+
+	for (i = 0; i < len; i++) {
+		v = sh->buf[i];
+		in = 0;
+		for (step = 0; step < sh->steps; step++) {
+			reg_write_relaxed(hw, sh->clr[v][step], sh->clr_off);
+			reg_write_relaxed(hw, sh->set[v][step], sh->set_off);
+			if (setup_loops)
+				shift_spin(setup_loops);
+			reg_write_relaxed(hw, sh->clock, sh->active_off);
+			if (active_loops)
+				shift_spin(active_loops);
+			if (rx) {
+				lev = reg_read(hw, sh->lev_off);
+				for (j = 0; j < sh->setup.in_width; j++)
+					in |= ((lev >> sh->in_bit[j]) & 1) << (sh->group_shift[step] + j);
+			}
 		}
+		if (rx)
+			sh->buf[i] = in;
+		/* a slave clocked by us does not mind a pause between bytes */
+		if ((i & 63) == 63)
+			cond_resched();
+	}
+	reg_write_relaxed(hw, sh->clock, sh->idle_off);
+}
 
-		switch (pass++) {
-		case 0:
-			pin = (char) simple_strtol(tmp, NULL, 0);
-			printk(KERN_ALERT "\npin: %d\n", pin);
-			break;
-		case 1:
-			strncpy(cmd, tmp, sizeof(cmd));
-			printk(KERN_ALERT "\ncmd: %s, strlen(tmp): %d\n", cmd, strlen(tmp));
-			break;
-		default:
-			break;
+/* Pulse widths carry the data, so the whole transfer runs with local interrupts disabled;
+ * shift_xfer() keeps that within TEST_GPIO_SHIFT_PULSE_MAX_LEN bytes and TEST_GPIO_SHIFT_PULSE_MAX_NS */
+static void shift_pulse(struct test_gpio_dev *dev, struct test_gpio_shifter *sh, u32 len)
+{
+	struct test_gpio_regs *hw = &dev->hw;
+	unsigned long flags;
+	unsigned int i, step;
+	int bit;
+
+	local_irq_save(flags);
+	for (i = 0; i < len; i++) {
+		for (step = 0; step < 8; step++) {
+			bit = (sh->buf[i] >> sh->group_shift[step]) & 1;
+			reg_write_relaxed(hw, sh->clock, sh->set_off);
+			shift_spin(sh->high_loops[bit]);
+			reg_write_relaxed(hw, sh->clock, sh->clr_off);
+			shift_spin(sh->low_loops[bit]);
 		}
 	}
+	local_irq_restore(flags);
+}
 
-	kfree(input_free);
+static int shift_xfer(struct test_gpio_dev *dev, struct test_gpio_file *priv, const struct test_gpio_shift_xfer *x)
+{
+	struct test_gpio_shifter *sh;
+	int err = 0;
 
+	if (x->len == 0 || x->len > TEST_GPIO_SHIFT_MAX_LEN)
+		return -EINVAL;
 
-	if (strcmp(cmd, "high") == 0) {
-		set_output(dev, pin, OUTPUT_HIGH);
+	mutex_lock(&priv->shift_lock);
+	sh = priv->shift;
+	if (sh == NULL) {
+		err = -EINVAL;
+		goto out;
 	}
-	else if (strcmp(cmd, "low") == 0) {
-		set_output(dev, pin, OUTPUT_LOW);
+	if (x->rx && !sh->setup.in_width) {
+		err = -EINVAL;
+		goto out;
 	}
-	else if (strcmp(cmd, "in") == 0) {
-		set_input(dev, pin);
+	/* bound the time spent with interrupts off */
+	if ((sh->setup.flags & TEST_GPIO_SHIFT_PULSE) &&
+		(x->len > TEST_GPIO_SHIFT_PULSE_MAX_LEN || (u64)x->len * 8 * sh->max_bit_ns > TEST_GPIO_SHIFT_PULSE_MAX_NS)) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	/* user data is copied before the first edge, so a page fault cannot stall the transfer */
+	if (x->tx) {
+		if (copy_from_user(sh->buf, u64_to_user_ptr(x->tx), x->len)) {
+			err = -EFAULT;
+			goto out;
+		}
 	}
 	else {
-		printk(KERN_ALERT "\nERROR: Invalid command!\n");
-		err = count;
-		goto out_err;
+		memset(sh->buf, 0, x->len);
+	}
+
+	if (sh->setup.flags & TEST_GPIO_SHIFT_PULSE)
+		shift_pulse(dev, sh, x->len);
+	else
+		shift_clocked(dev, sh, x->len, x->rx != 0);
+
+	if (x->rx && copy_to_user(u64_to_user_ptr(x->rx), sh->buf, x->len))
+		err = -EFAULT;
+out:
+	mutex_unlock(&priv->shift_lock);
+	return err;
+}
+
+/* In text mode, the whole table is formatted from one register snapshot, taken when reading starts at position 0,
+ * and returned in as few read() calls as the user buffer allows.
+ * In binary mode, every read() returns one fresh struct test_gpio_status, regardless of the file position. */
+static ssize_t do_read(struct file *file, char __user *buf, size_t count, loff_t * ppos)
+{
+	struct test_gpio_file *priv = file->private_data;
+	struct test_gpio_status status;
+
+	if (priv->read_mode == TEST_GPIO_READ_EVENTS)
+		return read_events(priv->dev, file, buf, count);
+	if (priv->read_mode == TEST_GPIO_READ_CAPTURE)
+		return read_capture(priv->dev, file, buf, count, ppos);
+
+	if (priv->read_mode == TEST_GPIO_READ_BINARY) {
+		if (count < sizeof(status))
+			return -EINVAL;
+		get_status(&priv->dev->hw, &status);
+		if (copy_to_user(buf, &status, sizeof(status)))
+			return -EFAULT;
+		return sizeof(status);
+	}
+
+	if (*ppos == 0) {
+		get_status(&priv->dev->hw, &status);
+		priv->text_len = format_status(&status, priv->text, sizeof(priv->text));
+	}
+
+	return simple_read_from_buffer(buf, count, ppos, priv->text, priv->text_len);
+}
+
+
+/* Execute one "pin cmd" text command, e.g. "17 high". Blank line is no-op. */
+static int do_text_cmd(struct test_gpio_dev *dev, const char *line, size_t len)
+{
+	unsigned int pin = 0;
+	size_t i = 0, digits = 0;
+
+	while (i < len && isspace(line[i]))
+		i++;
+	if (i == len)
+		return 0;
+
+	for (; i < len && isdigit(line[i]); i++, digits++) {
+		pin = pin * 10 + (line[i] - '0');
+		if (pin >= NUM_GPIOS)
+			return -EINVAL;
+	}
+	if (digits == 0)
+		return -EINVAL;
+
+	while (i < len && isspace(line[i]))
+		i++;
+	while (len > i && isspace(line[len - 1]))
+		len--;
+	line += i;
+	len -= i;
+
+	if (len == 4 && memcmp(line, "high", 4) == 0)
+		return set_output(&dev->hw, pin, OUTPUT_HIGH);
+	if (len == 3 && memcmp(line, "low", 3) == 0)
+		return set_output(&dev->hw, pin, OUTPUT_LOW);
+	if (len == 2 && memcmp(line, "in", 2) == 0)
+		return set_input(&dev->hw, pin);
+
+	return -EINVAL;
+}
+
+static int do_binary_cmd(struct test_gpio_dev *dev, const struct test_gpio_op *op)
+{
+	if (op->pin >= NUM_GPIOS)
+		return -EINVAL;
+
+	switch (op->op) {
+	case TEST_GPIO_OP_LOW:
+		return set_output(&dev->hw, op->pin, OUTPUT_LOW);
+	case TEST_GPIO_OP_HIGH:
+		return set_output(&dev->hw, op->pin, OUTPUT_HIGH);
+	case TEST_GPIO_OP_IN:
+		return set_input(&dev->hw, op->pin);
+	default:
+		return -EINVAL;
+	}
+}
+
+/* One write() may carry many commands: newline separated "pin cmd" lines in text mode,
+ * or an array of struct test_gpio_op in binary mode (TEST_GPIO_IOCTL_SET_WRITE_MODE).
+ * User data is copied in WRITE_CHUNK_SIZE pieces through a stack buffer, so nothing is allocated per call.
+ * Commands are executed in order. If one is invalid, the bytes of the commands executed before it are returned,
+ * or -EINVAL if it is the first one. Last text line does not need a trailing newline. */
+#define WRITE_CHUNK_SIZE	128
+#define TEXT_LINE_MAX		32
+
+static ssize_t do_write(struct file *file, const char __user *buf, size_t count, loff_t * ppos)
+{
+	struct test_gpio_file *priv = file->private_data;
+	struct test_gpio_dev *dev = priv->dev;
+	char chunk[WRITE_CHUNK_SIZE];
+	char line[TEXT_LINE_MAX];
+	size_t pos, n, j, line_len = 0, done = 0;
+	int err;
+
+	if (priv->write_mode == TEST_GPIO_WRITE_BINARY) {
+		struct test_gpio_op *ops = (struct test_gpio_op *)chunk;
+
+		if (count % sizeof(struct test_gpio_op))
+			return -EINVAL;
+		for (pos = 0; pos < count; pos += n) {
+			n = min_t(size_t, count - pos, sizeof(chunk));
+			if (copy_from_user(chunk, buf + pos, n))
+				return done ? done : -EFAULT;
+			for (j = 0; j < n / sizeof(struct test_gpio_op); j++) {
+				err = do_binary_cmd(dev, &ops[j]);
+				if (err)
+					return done ? done : err;
+				done += sizeof(struct test_gpio_op);
+			}
+		}
+		return count;
+	}
+
+	for (pos = 0; pos < count; pos += n) {
+		n = min_t(size_t, count - pos, sizeof(chunk));
+		if (copy_from_user(chunk, buf + pos, n))
+			return done ? done : -EFAULT;
+
+		for (j = 0; j < n; j++) {
+			if (chunk[j] == '\n') {
+				err = do_text_cmd(dev, line, line_len);
+				if (err)
+					return done ? done : err;
+				line_len = 0;
+				done = pos + j + 1;
+			}
+			else if (line_len < sizeof(line)) {
+				line[line_len++] = chunk[j];
+			}
+			else {
+				return done ? done : -EINVAL;
+			}
+		}
 	}
 
+	if (line_len) {
+		err = do_text_cmd(dev, line, line_len);
+		if (err)
+			return done ? done : err;
+	}
 
-	printk(KERN_ALERT "\n----- [%s] [%d] OK!!!\n", __FUNCTION__, __LINE__);
 	return count;
+}
 
-out_err:
-	return err;
+static long do_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct test_gpio_file *priv = file->private_data;
+	struct test_gpio_dev *dev = priv->dev;
+	struct test_gpio_masks masks;
+	struct test_gpio_status status;
+	struct test_gpio_edges edges;
+	struct test_gpio_event_stats stats;
+	struct test_gpio_pattern pattern;
+	struct test_gpio_pwm pwm;
+	struct test_gpio_timing_stats timing;
+	struct test_gpio_capture capture;
+	struct test_gpio_capture_status cap_status;
+	struct test_gpio_shift_setup shift;
+	struct test_gpio_shift_xfer xfer;
+	int mode, err;
+
+	switch (cmd) {
+	case TEST_GPIO_IOCTL_SET_MASKS:
+		if (copy_from_user(&masks, (void __user *)arg, sizeof(masks)))
+			return -EFAULT;
+		return set_masks(&dev->hw, &masks);
+
+	case TEST_GPIO_IOCTL_GET_STATUS:
+		get_status(&dev->hw, &status);
+		if (copy_to_user((void __user *)arg, &status, sizeof(status)))
+			return -EFAULT;
+		return 0;
+
+	case TEST_GPIO_IOCTL_SET_READ_MODE:
+		if (get_user(mode, (int __user *)arg))
+			return -EFAULT;
+		if (mode != TEST_GPIO_READ_TEXT && mode != TEST_GPIO_READ_BINARY && mode != TEST_GPIO_READ_EVENTS &&
+		    mode != TEST_GPIO_READ_CAPTURE)
+			return -EINVAL;
+		priv->read_mode = mode;
+		return 0;
+
+	case TEST_GPIO_IOCTL_SET_WRITE_MODE:
+		if (get_user(mode, (int __user *)arg))
+			return -EFAULT;
+		if (mode != TEST_GPIO_WRITE_TEXT && mode != TEST_GPIO_WRITE_BINARY)
+			return -EINVAL;
+		priv->write_mode = mode;
+		return 0;
+
+	case TEST_GPIO_IOCTL_SET_EDGES:
+		if (copy_from_user(&edges, (void __user *)arg, sizeof(edges)))
+			return -EFAULT;
+		return set_edges(dev, &edges);
+
+	case TEST_GPIO_IOCTL_GET_EVENT_STATS:
+		spin_lock(&dev->ev_lock);
+		stats.dropped = dev->ev_dropped;
+		spin_unlock(&dev->ev_lock);
+		stats.queued = events_queued(dev);
+		stats.size = dev->ev_size;
+		if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+
+	case TEST_GPIO_IOCTL_PATTERN_LOAD:
+		if (copy_from_user(&pattern, (void __user *)arg, sizeof(pattern)))
+			return -EFAULT;
+		mutex_lock(&dev->pattern_lock);
+		err = pattern_load(dev, &pattern);
+		mutex_unlock(&dev->pattern_lock);
+		return err;
+
+	case TEST_GPIO_IOCTL_PATTERN_START:
+		mutex_lock(&dev->pattern_lock);
+		err = pattern_start(dev);
+		mutex_unlock(&dev->pattern_lock);
+		return err;
+
+	case TEST_GPIO_IOCTL_PATTERN_STOP:
+		mutex_lock(&dev->pattern_lock);
+		pattern_stop(dev);
+		mutex_unlock(&dev->pattern_lock);
+		return 0;
+
+	case TEST_GPIO_IOCTL_SET_PWM:
+		if (copy_from_user(&pwm, (void __user *)arg, sizeof(pwm)))
+			return -EFAULT;
+		mutex_lock(&dev->pattern_lock);
+		err = pwm_set(dev, &pwm);
+		mutex_unlock(&dev->pattern_lock);
+		return err;
+
+	case TEST_GPIO_IOCTL_GET_TIMING_STATS:
+		spin_lock_irq(&dev->timing_lock);
+		timing = dev->timing;
+		spin_unlock_irq(&dev->timing_lock);
+		if (copy_to_user((void __user *)arg, &timing, sizeof(timing)))
+			return -EFAULT;
+		return 0;
+
+	case TEST_GPIO_IOCTL_CAPTURE_START:
+		if (copy_from_user(&capture, (void __user *)arg, sizeof(capture)))
+			return -EFAULT;
+		mutex_lock(&dev->capture_lock);
+		err = capture_start(dev, &capture);
+		mutex_unlock(&dev->capture_lock);
+		return err;
+
+	case TEST_GPIO_IOCTL_CAPTURE_STOP:
+		mutex_lock(&dev->capture_lock);
+		capture_stop(dev);
+		mutex_unlock(&dev->capture_lock);
+		return 0;
+
+	case TEST_GPIO_IOCTL_CAPTURE_STATUS:
+		capture_status(dev, &cap_status);
+		if (copy_to_user((void __user *)arg, &cap_status, sizeof(cap_status)))
+			return -EFAULT;
+		return 0;
+
+	case TEST_GPIO_IOCTL_SHIFT_SETUP:
+		if (copy_from_user(&shift, (void __user *)arg, sizeof(shift)))
+			return -EFAULT;
+		return shift_setup(dev, priv, &shift);
+
+	case TEST_GPIO_IOCTL_SHIFT_XFER:
+		if (copy_from_user(&xfer, (void __user *)arg, sizeof(xfer)))
+			return -EFAULT;
+		return shift_xfer(dev, priv, &xfer);
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* read()/write()/ioctl() entry points only add the test_gpio_fop tracepoint.
+ * Time is taken only while the tracepoint is enabled, so the disabled cost is one not-taken branch. */
+static inline u64 fop_start(void)
+{
+	return trace_test_gpio_fop_enabled() ? ktime_get_ns() : 0;
+}
+
+static inline void fop_trace(struct file *file, int op, unsigned int arg, size_t len, long ret, u64 start)
+{
+	if (trace_test_gpio_fop_enabled())
+		trace_test_gpio_fop(file_to_dev(file)->miscdev.name, op, arg, len, ret, ktime_get_ns() - start);
+}
+
+static ssize_t test_gpio_read(struct file *file, char __user *buf, size_t count, loff_t * ppos)
+{
+	struct test_gpio_file *priv = file->private_data;
+	u64 start = fop_start();
+	ssize_t ret;
+
+	ret = do_read(file, buf, count, ppos);
+	fop_trace(file, TEST_GPIO_TRACE_READ, priv->read_mode, count, ret, start);
+	return ret;
+}
+
+static ssize_t test_gpio_write(struct file *file, const char __user *buf, size_t count, loff_t * ppos)
+{
+	struct test_gpio_file *priv = file->private_data;
+	u64 start = fop_start();
+	ssize_t ret;
+
+	ret = do_write(file, buf, count, ppos);
+	fop_trace(file, TEST_GPIO_TRACE_WRITE, priv->write_mode, count, ret, start);
+	return ret;
+}
+
+static long test_gpio_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	u64 start = fop_start();
+	long ret;
+
+	ret = do_ioctl(file, cmd, arg);
+	fop_trace(file, TEST_GPIO_TRACE_IOCTL, cmd, _IOC_SIZE(cmd), ret, start);
+	return ret;
+}
+
+/* Map the page holding the GPIO registers into userspace, so GPSET/GPCLR can be written without a syscall.
+ * Registers start at offset (phys & ~PAGE_MASK) within the mapping, which is 0 for 0x20200000.
+ * Mapping is non-cached, and who may do it is decided by the device node permissions.
+ * At offset TEST_GPIO_MMAP_CAPTURE, the capture buffer is mapped read only instead. */
+static int test_gpio_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct test_gpio_dev *dev = file_to_dev(file);
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (vma->vm_pgoff == TEST_GPIO_MMAP_CAPTURE >> PAGE_SHIFT) {
+		if (dev->capture == NULL)
+			return -ENODEV;
+		if (vma->vm_flags & VM_WRITE)
+			return -EPERM;
+		vma->vm_flags &= ~VM_MAYWRITE;
+		/* remap_vmalloc_range checks that the mapping fits into the buffer */
+		return remap_vmalloc_range(vma, dev->capture, 0);
+	}
+
+	if (vma->vm_pgoff != 0 || size > PAGE_SIZE)
+		return -EINVAL;
+
+	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	vma->vm_flags |= VM_IO | VM_DONTEXPAND | VM_DONTDUMP;
+
+	return io_remap_pfn_range(vma, vma->vm_start, dev->phys >> PAGE_SHIFT, size, vma->vm_page_prot);
 }
 
 /******************************************************************************
@@ -300,83 +1486,290 @@ out_err:
  *
  *****************************************************************************/
 
-/* sysfs file (attr->attr.name) is in format: testgpioX, where X is the pin number
- * This functon returns the pin number extracted from the file name
- */
-static char get_pin_nb(struct device_attribute *attr)
+/* testgpioN/value: level of the pin (0 or 1). Writing 0 or 1 sets the pin as output low or high. */
+static ssize_t value_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct test_gpio_dev *mydrv = dev_get_drvdata(dev);
+	int pin = to_test_gpio_attr(attr)->pin;
+	unsigned int val = (reg_read(&mydrv->hw, GET_GPLEV_REG_OFFSET(pin)) >> (pin % 32)) & 1;
+
+	trace_test_gpio_sysfs_show(pin, false, val);
+	return sprintf(buf, "%u\n", val);
+}
+
+static ssize_t value_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
-	char *tmp, pin;
-	/* strsep() is used to get pin number from attr->attr.name. attr->attr.name is in the format testgpioX, where the pin number is X.
-	 * strsep() moves pointer passed as the first argument. Therefore attr->attr.name cannot be used as it is declared as const.
-	 * Also, we need to preserve value of the fname after allocation (fname_free) in order tobe able to free it properly */
-	char *fname = kzalloc(strlen(attr->attr.name) + 1, GFP_KERNEL);
-	char *fname_free = fname;
+	struct test_gpio_dev *mydrv = dev_get_drvdata(dev);
+	int pin = to_test_gpio_attr(attr)->pin;
+	bool high;
 
-	strcpy(fname, attr->attr.name);
-	tmp = strsep((char **)&fname, "o");
-	pin = (char) simple_strtol(fname, NULL, 0);
-	kfree(fname_free);
+	if (kstrtobool(buf, &high))
+		return -EINVAL;
+
+	set_output(&mydrv->hw, pin, high ? OUTPUT_HIGH : OUTPUT_LOW);
+	return count;
+}
 
-	return pin;
+/* testgpioN/direction: "in", "out" or "alt" (pin has an alternate function).
+ * Accepts "in", "out", and also "high"/"low" which set output with the given level. */
+static ssize_t direction_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct test_gpio_dev *mydrv = dev_get_drvdata(dev);
+	int pin = to_test_gpio_attr(attr)->pin;
+	int val = (reg_read(&mydrv->hw, GET_GPFSEL_REG_OFFSET(pin)) >> GET_GPFSEL_PIN_OFFSET(pin)) & 7;
+
+	trace_test_gpio_sysfs_show(pin, true, val);
+	if (val == REG_FSEL_GPIO_IN)
+		return sprintf(buf, "in\n");
+	if (val == REG_FSEL_GPIO_OUT)
+		return sprintf(buf, "out\n");
+	return sprintf(buf, "alt\n");
 }
 
+static ssize_t direction_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct test_gpio_dev *mydrv = dev_get_drvdata(dev);
+	int pin = to_test_gpio_attr(attr)->pin;
+
+	if (sysfs_streq(buf, "in"))
+		set_input(&mydrv->hw, pin);
+	else if (sysfs_streq(buf, "out"))
+		update_fsel(&mydrv->hw, BIT_ULL(pin), 0);
+	else if (sysfs_streq(buf, "high"))
+		set_output(&mydrv->hw, pin, OUTPUT_HIGH);
+	else if (sysfs_streq(buf, "low"))
+		set_output(&mydrv->hw, pin, OUTPUT_LOW);
+	else
+		return -EINVAL;
+
+	return count;
+}
 
-static ssize_t test_gpio_show(struct device *dev, struct device_attribute *attr, char *buf)
+/* NAME/value: the bus pins as one unsigned integer (decimal, or 0x/0 prefixed). Writing sets all of them
+ * as outputs with the given value, with 2 to 4 GPCLR/GPSET writes wherever the pins are. */
+static ssize_t bus_value_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	char pin;
-	int val, level;
-	char tmp_buf[200] = {0};
 	struct test_gpio_dev *mydrv = dev_get_drvdata(dev);
-	int reg_offset, pin_offset;
+	struct test_gpio_bus_sysfs *bs = container_of(attr, struct test_gpio_bus_sysfs, value);
 
-	pin = get_pin_nb(attr);
-	printk(KERN_ALERT "\n    - pin: %d\n", pin);
-	reg_offset = GET_GPFSEL_REG_OFFSET(pin);
-	pin_offset = GET_GPFSEL_PIN_OFFSET(pin);
+	return sprintf(buf, "%u\n", bus_read(&mydrv->hw, &bs->bus));
+}
 
-	val = reg_read(mydrv, reg_offset);
-	val = (val >> pin_offset) & 7;
+static ssize_t bus_value_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct test_gpio_dev *mydrv = dev_get_drvdata(dev);
+	struct test_gpio_bus_sysfs *bs = container_of(attr, struct test_gpio_bus_sysfs, value);
+	u32 val;
+	int err;
 
-	if (val == REG_FSEL_GPIO_IN || val == REG_FSEL_GPIO_OUT) {
-		reg_offset = GET_GPLEV_REG_OFFSET(pin);
-		pin_offset = GET_GPLEV_PIN_OFFSET(pin);
+	if (kstrtou32(buf, 0, &val))
+		return -EINVAL;
+	err = bus_write(&mydrv->hw, &bs->bus, val);
+	return err ? err : count;
+}
 
-		level = reg_read(mydrv, reg_offset);
-		level = (level >> pin_offset) & 1;
-		if (val == REG_FSEL_GPIO_IN)
-			snprintf(tmp_buf, sizeof(tmp_buf), "input: %d", level);
-		else
-			snprintf(tmp_buf, sizeof(tmp_buf), "output: %d", level);
+/* NAME/direction: "in" or "out" when all bus pins have that direction, "mixed" otherwise. Accepts "in" and "out". */
+static ssize_t bus_direction_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct test_gpio_dev *mydrv = dev_get_drvdata(dev);
+	struct test_gpio_bus_sysfs *bs = container_of(attr, struct test_gpio_bus_sysfs, direction);
+	bool in = true, out = true;
+	u32 val;
+	int reg;
+
+	for (reg = 0; reg < NUM_GPFSEL_REGS; reg++) {
+		if (!bs->bus.fsel_mask[reg])
+			continue;
+		val = reg_read(&mydrv->hw, GPFSEL + reg * 4) & bs->bus.fsel_mask[reg];
+		in &= (val == 0);
+		out &= (val == bs->bus.fsel_out[reg]);
 	}
-	else {
-		snprintf(tmp_buf, sizeof(tmp_buf), "Not input/output pin!");
+	return sprintf(buf, "%s\n", in ? "in" : out ? "out" : "mixed");
+}
+
+static ssize_t bus_direction_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct test_gpio_dev *mydrv = dev_get_drvdata(dev);
+	struct test_gpio_bus_sysfs *bs = container_of(attr, struct test_gpio_bus_sysfs, direction);
+
+	if (sysfs_streq(buf, "in"))
+		update_fsel(&mydrv->hw, 0, bs->bus.mask);
+	else if (sysfs_streq(buf, "out"))
+		update_fsel(&mydrv->hw, bs->bus.mask, 0);
+	else
+		return -EINVAL;
+
+	return count;
+}
+
+/* NAME/pins: pin numbers of value bits 0, 1, ... */
+static ssize_t bus_pins_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct test_gpio_bus_sysfs *bs = container_of(attr, struct test_gpio_bus_sysfs, pins_attr);
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < bs->npins; i++)
+		len += sprintf(buf + len, "%s%d", i ? " " : "", bs->pins[i]);
+	return len + sprintf(buf + len, "\n");
+}
+
+/* Parse "name:pin0:pin1:..." and build the lookup tables */
+static int bus_parse(struct device *dev, const char *arg, struct test_gpio_bus_sysfs *bs)
+{
+	char *copy, *s, *tok;
+	int pin, err = 0;
+
+	copy = kstrdup(arg, GFP_KERNEL);
+	if (copy == NULL)
+		return -ENOMEM;
+
+	s = copy;
+	tok = strsep(&s, ":");
+	if (!*tok || strlen(tok) >= sizeof(bs->name) || strchr(tok, '/') || s == NULL)
+		err = -EINVAL;
+	else
+		strcpy(bs->name, tok);
+	while (!err && (tok = strsep(&s, ":")) != NULL) {
+		if (bs->npins == BUS_MAX_PINS || kstrtoint(tok, 10, &pin))
+			err = -EINVAL;
+		else
+			bs->pins[bs->npins++] = pin;
 	}
+	kfree(copy);
 
-	return snprintf(buf, PAGE_SIZE, "%s\n", tmp_buf);
+	if (!err)
+		err = bus_init(&bs->bus, bs->pins, bs->npins);
+	if (err)
+		dev_err(dev, "invalid bus parameter %s\n", arg);
+	return err;
 }
 
-static ssize_t test_gpio_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+static int sysfs_bus_create(struct platform_device *pdev, const char *arg, const struct attribute_group **group)
 {
-	char pin;
-	struct test_gpio_dev *mydrv = dev_get_drvdata(dev);
+	struct test_gpio_bus_sysfs *bs;
+	int err;
+
+	bs = devm_kzalloc(&pdev->dev, sizeof(*bs), GFP_KERNEL);
+	if (bs == NULL)
+		return -ENOMEM;
+	err = bus_parse(&pdev->dev, arg, bs);
+	if (err)
+		return err;
+
+	sysfs_attr_init(&bs->value.attr);
+	bs->value.attr.name = "value";
+	bs->value.attr.mode = VERIFY_OCTAL_PERMISSIONS(S_IWUSR | S_IRUGO);
+	bs->value.show = bus_value_show;
+	bs->value.store = bus_value_store;
+
+	sysfs_attr_init(&bs->direction.attr);
+	bs->direction.attr.name = "direction";
+	bs->direction.attr.mode = VERIFY_OCTAL_PERMISSIONS(S_IWUSR | S_IRUGO);
+	bs->direction.show = bus_direction_show;
+	bs->direction.store = bus_direction_store;
+
+	sysfs_attr_init(&bs->pins_attr.attr);
+	bs->pins_attr.attr.name = "pins";
+	bs->pins_attr.attr.mode = VERIFY_OCTAL_PERMISSIONS(S_IRUGO);
+	bs->pins_attr.show = bus_pins_show;
+
+	bs->attrs[0] = &bs->value.attr;
+	bs->attrs[1] = &bs->direction.attr;
+	bs->attrs[2] = &bs->pins_attr.attr;
+	bs->group.name = bs->name;
+	bs->group.attrs = bs->attrs;
+	*group = &bs->group;
+	return 0;
+}
 
-	pin = get_pin_nb(attr);
+/* Bus directories share the device directory with the testgpioN groups, the other buses and the driver core's
+ * own entries (power, driver, subsystem, uevent, ...), so a name must not clash with any of them */
+static int bus_name_check(struct device *dev, const struct attribute_group **buses, int count, const char *name)
+{
+	struct kernfs_node *kn;
+	int i;
 
-	if (strncmp(buf, "high", 4) == 0) {
-		set_output(mydrv, pin, OUTPUT_HIGH);
+	if (strncmp(name, "testgpio", strlen("testgpio")) == 0) {
+		dev_err(dev, "invalid bus name %s: testgpio prefix is reserved for pins\n", name);
+		return -EINVAL;
 	}
-	else if (strncmp(buf, "low", 3) == 0) {
-		set_output(mydrv, pin, OUTPUT_LOW);
+	for (i = 0; i < count; i++) {
+		if (strcmp(buses[i]->name, name) == 0) {
+			dev_err(dev, "invalid bus name %s: used by another bus\n", name);
+			return -EINVAL;
+		}
 	}
-	else if (strncmp(buf, "in", 2) == 0) {
-		set_input(mydrv, pin);
+	kn = sysfs_get_dirent(dev->kobj.sd, (const unsigned char *)name);
+	if (kn) {
+		sysfs_put(kn);
+		dev_err(dev, "invalid bus name %s: device already has a sysfs entry of that name\n", name);
+		return -EINVAL;
 	}
-	else {
-		printk(KERN_ALERT "\nERROR: Invalid command: %s\n", buf);
-//		err = count;
-//		goto out_err;
+	return 0;
+}
+
+/* Build testgpioN groups for the pins given by the "gpio" module parameter, or for all pins if it is not given,
+ * followed by one group per "bus" module parameter.
+ * Everything is allocated here once, so sysfs accesses do no allocation and no string parsing. */
+static int sysfs_pins_create(struct platform_device *pdev, struct test_gpio_dev *dev)
+{
+	int i, n, pin, err;
+	struct test_gpio_pin_sysfs *ps;
+	u64 seen = 0;
+
+	n = gpio_argc > 0 ? gpio_argc : NUM_GPIOS;
+	dev->pin_sysfs = devm_kcalloc(&pdev->dev, n, sizeof(*dev->pin_sysfs), GFP_KERNEL);
+	dev->groups = devm_kcalloc(&pdev->dev, n + bus_argc + 1, sizeof(*dev->groups), GFP_KERNEL);
+	if (dev->pin_sysfs == NULL || dev->groups == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		pin = gpio_argc > 0 ? gpio[i] : i;
+		if (pin < 0 || pin >= NUM_GPIOS) {
+			dev_err(&pdev->dev, "invalid gpio parameter %d\n", pin);
+			return -EINVAL;
+		}
+		/* a second testgpioN group of the same name would fail sysfs_create_groups() with a warning */
+		if (seen & BIT_ULL(pin)) {
+			dev_err(&pdev->dev, "gpio parameter lists pin %d more than once\n", pin);
+			return -EINVAL;
+		}
+		seen |= BIT_ULL(pin);
+
+		ps = &dev->pin_sysfs[i];
+		snprintf(ps->name, sizeof(ps->name), "testgpio%d", pin);
+
+		sysfs_attr_init(&ps->value.attr.attr);
+		ps->value.attr.attr.name = "value";
+		ps->value.attr.attr.mode = VERIFY_OCTAL_PERMISSIONS(S_IWUSR | S_IRUGO);
+		ps->value.attr.show = value_show;
+		ps->value.attr.store = value_store;
+		ps->value.pin = pin;
+
+		sysfs_attr_init(&ps->direction.attr.attr);
+		ps->direction.attr.attr.name = "direction";
+		ps->direction.attr.attr.mode = VERIFY_OCTAL_PERMISSIONS(S_IWUSR | S_IRUGO);
+		ps->direction.attr.show = direction_show;
+		ps->direction.attr.store = direction_store;
+		ps->direction.pin = pin;
+
+		ps->attrs[0] = &ps->value.attr.attr;
+		ps->attrs[1] = &ps->direction.attr.attr;
+		ps->group.name = ps->name;
+		ps->group.attrs = ps->attrs;
+		dev->groups[i] = &ps->group;
 	}
-	return count;
+
+	for (i = 0; i < bus_argc; i++) {
+		err = sysfs_bus_create(pdev, bus[i], &dev->groups[n + i]);
+		if (!err)
+			err = bus_name_check(&pdev->dev, &dev->groups[n], i, dev->groups[n + i]->name);
+		if (err)
+			return err;
+	}
+
+	return sysfs_create_groups(&pdev->dev.kobj, dev->groups);
 }
 
 
@@ -395,7 +1788,6 @@ static int test_gpio_probe(struct platform_device *pdev)
 	struct test_gpio_dev *dev;
 //	int val;
 	int err, i;
-	char name[20];
 
 	//pr_info("Called test_gpio, id->name: %s\n", id->name);
 	pr_info("Called test_gpio_probe\n");
@@ -427,8 +1819,8 @@ static int test_gpio_probe(struct platform_device *pdev)
  *     request_mem_region on same memory region will cause an error.
  **/
 #if 0
-	dev->regs = devm_ioremap_resource(&pdev->dev, regs);
-	if (!dev->regs) {
+	dev->hw.base = devm_ioremap_resource(&pdev->dev, regs);
+	if (!dev->hw.base) {
 		dev_err(&pdev->dev, "Cannot remap registers\n");
 		return -ENOMEM;
 	}
@@ -460,18 +1852,54 @@ static int test_gpio_probe(struct platform_device *pdev)
  *   		▶ Takes care of both the request and remapping operations!
  */
 #if 0
-	dev->regs  = ioremap(regs->start, resource_size(regs));
-	if (!dev->regs) {
+	dev->hw.base  = ioremap(regs->start, resource_size(regs));
+	if (!dev->hw.base) {
 		dev_err(&pdev->dev, "could not remap memory\n");
 		return -1;
 	}
 #endif
-	dev->regs = devm_ioremap(&pdev->dev, regs->start, resource_size(regs));
-	if (dev->regs == NULL) {
+	dev->hw.base = devm_ioremap(&pdev->dev, regs->start, resource_size(regs));
+	if (dev->hw.base == NULL) {
 		dev_err(&pdev->dev, "failed to ioremap() registers\n");
 		return -ENODEV;
 	}
-	pr_info("\nvirtual address: 0x%x!!!\n", (int)dev->regs); //virtual address: 0xf2200000
+	pr_info("\nvirtual address: 0x%x!!!\n", (int)dev->hw.base); //virtual address: 0xf2200000
+	dev->phys = regs->start;
+
+	regs_init(&dev->hw);
+
+	/* Edge capture. GPIO bank interrupts are optional, taken from the "interrupts" property of the test_gpio node:
+	 * first one for bank 0 (GPIO 0-31), second one for bank 1 (GPIO 32-53). */
+	dev->ev_size = roundup_pow_of_two(max(events_size, 1));
+	dev->events = devm_kcalloc(&pdev->dev, dev->ev_size, sizeof(struct test_gpio_event), GFP_KERNEL);
+	if (dev->events == NULL)
+		return -ENOMEM;
+	spin_lock_init(&dev->ev_lock);
+	spin_lock_init(&dev->edge_lock);
+	mutex_init(&dev->ev_read_lock);
+	init_waitqueue_head(&dev->ev_wait);
+	waveform_init(dev);
+	err = capture_init(pdev, dev);
+	if (err)
+		return err;
+
+	for (i = 0; i < 2; i++) {
+		dev->banks[i].dev = dev;
+		dev->banks[i].bank = i;
+		dev->banks[i].irq = platform_get_irq(pdev, i);
+		if (dev->banks[i].irq <= 0) {
+			dev_info(&pdev->dev, "no interrupt for GPIO bank %d, edge capture disabled\n", i);
+			continue;
+		}
+		err = devm_request_threaded_irq(&pdev->dev, dev->banks[i].irq, test_gpio_irq, test_gpio_irq_thread,
+										IRQF_ONESHOT, dev_name(&pdev->dev), &dev->banks[i]);
+		if (err < 0) {
+			/* usually still owned by the GPIO controller node, see readme.txt */
+			dev_err(&pdev->dev, "cannot request interrupt %d (%d), edge capture disabled for GPIO bank %d\n",
+					dev->banks[i].irq, err, i);
+			dev->banks[i].irq = -1;
+		}
+	}
 
 
 	/* IMPLEMENTATION OF CHARACTER DRIVER USING MISC FRAMEWORK
@@ -481,28 +1909,6 @@ static int test_gpio_probe(struct platform_device *pdev)
 	 * Another advantage is that devices are integrated in the Device Model (device ﬁles appearing in devtmpfs,
 	 * which you don't have with raw character devices).
 	 */
-	//static DEVICE_ATTR(testgpio, S_IWUSR | S_IRUGO, test_gpio_show, test_gpio_store);
-	if (gpio_argc > 0) {
-		dev->dev_attr = devm_kzalloc(&pdev->dev, gpio_argc * sizeof(struct device_attribute), GFP_ATOMIC);
-		dev->sysfiles = devm_kzalloc(&pdev->dev, gpio_argc * sizeof(dev->sysfiles), GFP_ATOMIC);
-		for (i = 0; i < gpio_argc; i++) {
-			pr_info("\n Param %d. %d\n", i, gpio[i]);
-			snprintf(name, sizeof(name), "testgpio%d", gpio[i]);
-			pr_info("\n name: %s\n", name);
-	//		dev->dev_attr[i] = __ATTR(testgpio, S_IWUSR | S_IRUGO, test_gpio_show, test_gpio_store);
-			dev->sysfiles[i] = devm_kzalloc(&pdev->dev, strlen(name)+1, GFP_ATOMIC);
-			strcpy(dev->sysfiles[i], name);
-
-			dev->dev_attr[i] = devm_kzalloc(&pdev->dev, sizeof(struct device_attribute), GFP_ATOMIC);
-			dev->dev_attr[i]->attr.name = dev->sysfiles[i];
-			dev->dev_attr[i]->attr.mode = VERIFY_OCTAL_PERMISSIONS(S_IWUSR | S_IRUGO);
-			dev->dev_attr[i]->show	= test_gpio_show;
-			dev->dev_attr[i]->store	= test_gpio_store;
-			//		device_create_file(&pdev->dev, &dev_attr_testgpio);
-			device_create_file(&pdev->dev, dev->dev_attr[i]);
-		}
-	}
-
 	/* At the end of the probe() routine, when the device is fully ready to work, the miscdevice structure is initialized for each found device:
 	 * • To get an automatically assigned minor number.
 	 * • To specify a name for the device ﬁle in devtmpfs. We propose to use devm_kasprintf(&pdev->dev, GFP_KERNEL, "test_gpio-%x", res->start).
@@ -522,6 +1928,14 @@ static int test_gpio_probe(struct platform_device *pdev)
 	 */
 	platform_set_drvdata(pdev, dev);
 
+	/* sysfs files are created last, when drvdata used by their show()/store() is already set */
+	err = sysfs_pins_create(pdev, dev);
+	if (err < 0) {
+		dev_err(&pdev->dev, "cannot create sysfs files\n");
+		misc_deregister(&dev->miscdev);
+		return err;
+	}
+
 
 
 	/* SUMMARY:
@@ -548,15 +1962,15 @@ static int test_gpio_remove(struct platform_device *pdev)
 {
 	int i;
 	struct test_gpio_dev *dev = platform_get_drvdata(pdev);
+	const struct test_gpio_edges no_edges = { 0 };
 
 	pr_info("Called test_gpio_remove\n");
-//	device_remove_file(&pdev->dev, &dev_attr_testgpio);
-	for (i = 0; i < gpio_argc; i++) {
-		pr_info("device_remove_file: %s\n", dev->dev_attr[i]->attr.name);
-		device_remove_file(&pdev->dev, dev->dev_attr[i]);
-	}
-
+	/* no new opens first; files still open are refused new timers by waveform_exit() and capture_exit() */
 	misc_deregister(&dev->miscdev);
+	waveform_exit(dev);
+	/* stop edge detection on our pins, interrupts themselves are released by devm */
+	set_edges(dev, &no_edges);
+	sysfs_remove_groups(&pdev->dev.kobj, dev->groups);
 
 
 	pr_info("test_gpio_remove OK!!!!!\n");
@@ -0,0 +1,186 @@
+#ifndef TEST_GPIO_IOCTL_H
+#define TEST_GPIO_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* Bit N of every mask below is GPIO pin N (0 - 53), so one mask covers both register banks:
+ * bits 0-31 go to GPSET0/GPCLR0, bits 32-53 go to GPSET1/GPCLR1. */
+struct test_gpio_masks {
+	__u64 set;		/* pins to drive high */
+	__u64 clear;	/* pins to drive low */
+	__u64 output;	/* pins to configure as output */
+	__u64 input;	/* pins to configure as input */
+};
+
+/* Command record written in TEST_GPIO_WRITE_BINARY mode, many of them per write() */
+struct test_gpio_op {
+	__u8 pin;
+	__u8 op;	/* TEST_GPIO_OP_* */
+};
+
+#define TEST_GPIO_OP_LOW	0	/* output low */
+#define TEST_GPIO_OP_HIGH	1	/* output high */
+#define TEST_GPIO_OP_IN		2	/* input */
+
+/* write() formats, selected per open file with TEST_GPIO_IOCTL_SET_WRITE_MODE */
+#define TEST_GPIO_WRITE_TEXT	0	/* newline separated "pin high|low|in" commands */
+#define TEST_GPIO_WRITE_BINARY	1	/* array of struct test_gpio_op */
+
+/* Snapshot of the pin state, returned by read() in binary mode and by TEST_GPIO_IOCTL_GET_STATUS.
+ * fsel[] holds raw GPFSEL0-5 values: 3-bit function code per pin, pin N at bits (N % 10) * 3 of fsel[N / 10]. */
+struct test_gpio_status {
+	__u64 level;	/* GPLEV1:GPLEV0, bit N is level of GPIO N */
+	__u32 fsel[6];
+};
+
+/* Pins whose edges are captured, set with TEST_GPIO_IOCTL_SET_EDGES. Pin may be in both masks.
+ * Replaces the previous selection; edge detection of pins never selected here is left untouched. */
+struct test_gpio_edges {
+	__u64 rising;
+	__u64 falling;
+};
+
+/* Captured edge, returned by read() in TEST_GPIO_READ_EVENTS mode */
+struct test_gpio_event {
+	__u64 timestamp;	/* CLOCK_MONOTONIC, ns */
+	__u32 pin;
+	__u32 level;		/* pin level right after the edge */
+};
+
+struct test_gpio_event_stats {
+	__u64 dropped;		/* events lost because the buffer was full */
+	__u32 queued;		/* events waiting to be read */
+	__u32 size;			/* buffer capacity in events */
+};
+
+/* Pattern step: set and clear masks are applied, then the next step follows after delay_ns (at least 1000 ns) */
+struct test_gpio_step {
+	__u64 delay_ns;
+	__u64 set;
+	__u64 clear;
+};
+
+#define TEST_GPIO_PATTERN_LOOP	0x1	/* restart from the first step after the last one */
+
+struct test_gpio_pattern {
+	__u64 steps;	/* user pointer to array of struct test_gpio_step */
+	__u32 count;	/* number of steps, at most 65536 */
+	__u32 flags;	/* TEST_GPIO_PATTERN_* */
+};
+
+/* Software PWM on one pin, up to 8 pins at the same time. period_ns 0 stops it. */
+struct test_gpio_pwm {
+	__u32 pin;
+	__u32 reserved;
+	__u64 period_ns;
+	__u64 duty_ns;	/* high time */
+};
+
+#define TEST_GPIO_LATE_HIST_SIZE	32
+
+/* How late pattern/PWM edges fired, since the last TEST_GPIO_IOCTL_PATTERN_START.
+ * late_hist[i] counts edges with lateness in [2^(i-1), 2^i) ns, late_hist[0] those on time. */
+struct test_gpio_timing_stats {
+	__u64 edges;
+	__u64 late_total_ns;
+	__u64 late_max_ns;
+	__u32 late_hist[TEST_GPIO_LATE_HIST_SIZE];
+};
+
+/* Logic analyzer capture: GPLEV0/1 are sampled from an hrtimer every period_ns, masked with pin_mask,
+ * and stored run-length encoded as struct test_gpio_sample records */
+struct test_gpio_capture {
+	__u64 period_ns;	/* sampling period, at least 1000 */
+	__u64 pin_mask;		/* pins recorded, other bits of levels are 0 */
+	__u64 samples;		/* stop after this many samples, 0 - only when stopped or the buffer is full */
+};
+
+/* count consecutive sampling periods had these levels. Periods skipped because the timer fired late
+ * are counted to the level sampled before them, so the counts always add up to the elapsed time. */
+struct test_gpio_sample {
+	__u64 levels;		/* GPLEV1:GPLEV0 & pin_mask */
+	__u32 count;
+	__u32 reserved;
+};
+
+struct test_gpio_capture_status {
+	__u64 start_ns;		/* CLOCK_MONOTONIC time of the first sample */
+	__u64 period_ns;
+	__u64 samples;		/* samples really taken */
+	__u64 missed;		/* periods skipped by a late timer */
+	__u32 records;		/* complete records, available to read() and through the mapping */
+	__u32 size;			/* buffer capacity in records */
+	__u32 running;
+	__u32 overflow;		/* capture stopped because the buffer was full */
+};
+
+/* mmap() offset of the capture buffer (read only, capacity * sizeof(struct test_gpio_sample) bytes).
+ * Offset 0 maps the register page. */
+#define TEST_GPIO_MMAP_CAPTURE	0x100000
+
+/* Bit-banged shift engine, configured per open file with TEST_GPIO_IOCTL_SHIFT_SETUP.
+ * Clocked mode: every byte is sent as 8 / width groups of width bits, most significant group first (least significant
+ * with TEST_GPIO_SHIFT_LSB_FIRST); out_pins[j] carries bit j of the group. Data changes while the clock is idle,
+ * setup_ns later the clock goes active, and after active_ns in_pins (if in_width is set) are sampled the same way.
+ * Pulse mode (WS2812 like): no clock, one data pin, every bit is a high pulse of t0h_ns/t1h_ns followed by
+ * t0l_ns/t1l_ns low, bits in the same order as in clocked mode. Interrupts are disabled during a pulse mode transfer,
+ * so it is limited to TEST_GPIO_SHIFT_PULSE_MAX_LEN bytes and TEST_GPIO_SHIFT_PULSE_MAX_NS of pulses per call.
+ * All pins must be in the same bank (0 - 31 or 32 - 53). Delays are minimums, 0 means as fast as the bus allows;
+ * they are busy loops calibrated by TEST_GPIO_IOCTL_SHIFT_SETUP, so setup again after a CPU frequency change. */
+#define TEST_GPIO_SHIFT_LSB_FIRST	0x1
+#define TEST_GPIO_SHIFT_CPOL		0x2	/* clock idles high, active edge is falling */
+#define TEST_GPIO_SHIFT_PULSE		0x4
+
+#define TEST_GPIO_SHIFT_MAX_LEN		65536	/* bytes per TEST_GPIO_IOCTL_SHIFT_XFER */
+#define TEST_GPIO_SHIFT_PULSE_MAX_LEN	2048	/* bytes per pulse mode TEST_GPIO_IOCTL_SHIFT_XFER */
+#define TEST_GPIO_SHIFT_PULSE_MAX_NS	20000000	/* pulse time of a pulse mode transfer, interrupts are off meanwhile */
+
+struct test_gpio_shift_setup {
+	__u32 flags;		/* TEST_GPIO_SHIFT_* */
+	__u8 clock_pin;
+	__u8 width;			/* data pins clocked in parallel: 1, 2, 4 or 8 (1 in pulse mode) */
+	__u8 in_width;		/* 0 - no shift-in, or equal to width */
+	__u8 reserved;
+	__u8 out_pins[8];
+	__u8 in_pins[8];
+	__u32 setup_ns;		/* clocked: data valid before the active edge */
+	__u32 active_ns;	/* clocked: clock held active */
+	__u32 t0h_ns;		/* pulse: high and low time of a 0 bit */
+	__u32 t0l_ns;
+	__u32 t1h_ns;		/* pulse: high and low time of a 1 bit */
+	__u32 t1l_ns;
+};
+
+struct test_gpio_shift_xfer {
+	__u64 tx;			/* user pointer to len bytes shifted out, 0 - zeros are shifted out */
+	__u64 rx;			/* user pointer to len bytes shifted in, 0 - nothing is returned */
+	__u32 len;			/* 1 - TEST_GPIO_SHIFT_MAX_LEN (TEST_GPIO_SHIFT_PULSE_MAX_LEN in pulse mode) */
+	__u32 reserved;
+};
+
+/* read() formats, selected per open file with TEST_GPIO_IOCTL_SET_READ_MODE */
+#define TEST_GPIO_READ_TEXT		0
+#define TEST_GPIO_READ_BINARY	1
+#define TEST_GPIO_READ_EVENTS	2	/* blocking read of struct test_gpio_event, poll() reports POLLIN when events are queued */
+#define TEST_GPIO_READ_CAPTURE	3	/* complete capture records from the file position on, blocks while capture runs */
+
+#define TEST_GPIO_IOCTL_MAGIC		0x34
+#define TEST_GPIO_IOCTL_SET_MASKS	_IOW(TEST_GPIO_IOCTL_MAGIC, 0, struct test_gpio_masks)
+#define TEST_GPIO_IOCTL_GET_STATUS	_IOR(TEST_GPIO_IOCTL_MAGIC, 1, struct test_gpio_status)
+#define TEST_GPIO_IOCTL_SET_READ_MODE	_IOW(TEST_GPIO_IOCTL_MAGIC, 2, int)
+#define TEST_GPIO_IOCTL_SET_EDGES	_IOW(TEST_GPIO_IOCTL_MAGIC, 3, struct test_gpio_edges)
+#define TEST_GPIO_IOCTL_GET_EVENT_STATS	_IOR(TEST_GPIO_IOCTL_MAGIC, 4, struct test_gpio_event_stats)
+#define TEST_GPIO_IOCTL_PATTERN_LOAD	_IOW(TEST_GPIO_IOCTL_MAGIC, 5, struct test_gpio_pattern)
+#define TEST_GPIO_IOCTL_PATTERN_START	_IO(TEST_GPIO_IOCTL_MAGIC, 6)
+#define TEST_GPIO_IOCTL_PATTERN_STOP	_IO(TEST_GPIO_IOCTL_MAGIC, 7)
+#define TEST_GPIO_IOCTL_SET_PWM		_IOW(TEST_GPIO_IOCTL_MAGIC, 8, struct test_gpio_pwm)
+#define TEST_GPIO_IOCTL_GET_TIMING_STATS	_IOR(TEST_GPIO_IOCTL_MAGIC, 9, struct test_gpio_timing_stats)
+#define TEST_GPIO_IOCTL_SET_WRITE_MODE	_IOW(TEST_GPIO_IOCTL_MAGIC, 10, int)
+#define TEST_GPIO_IOCTL_CAPTURE_START	_IOW(TEST_GPIO_IOCTL_MAGIC, 11, struct test_gpio_capture)
+#define TEST_GPIO_IOCTL_CAPTURE_STOP	_IO(TEST_GPIO_IOCTL_MAGIC, 12)
+#define TEST_GPIO_IOCTL_CAPTURE_STATUS	_IOR(TEST_GPIO_IOCTL_MAGIC, 13, struct test_gpio_capture_status)
+#define TEST_GPIO_IOCTL_SHIFT_SETUP	_IOW(TEST_GPIO_IOCTL_MAGIC, 14, struct test_gpio_shift_setup)
+#define TEST_GPIO_IOCTL_SHIFT_XFER	_IOW(TEST_GPIO_IOCTL_MAGIC, 15, struct test_gpio_shift_xfer)
+
+#endif
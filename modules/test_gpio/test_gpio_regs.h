@@ -0,0 +1,310 @@
+#ifndef TEST_GPIO_REGS_H
+#define TEST_GPIO_REGS_H
+
+/* BCM2835 GPIO register block and the register level operations of test_gpio.
+ *
+ * Everything here reaches the hardware only through reg_read()/reg_write() on struct test_gpio_regs,
+ * which the includer defines after this header. The driver backs them with readl()/writel() on the
+ * ioremap()-ed block; test/regs_test.c backs them with a simulated 0xb4 byte register file on the host,
+ * so the exact register writes of every operation can be checked, and timed, without a Pi. */
+
+#define NUM_GPIOS 54
+#define NUM_GPFSEL_REGS	((NUM_GPIOS + 9) / 10)
+#define GPIO_ALL_MASK	((1ULL << NUM_GPIOS) - 1)
+
+/* GPIO register offsets */
+
+/* there are 5 GPFSEL 32bit registers, starting from offset 0x00.
+ * Every register controls 10 pins, 3 bits per pin, so the last two bits are unused (reserved).
+ * 000 - GPIO pin is input
+ * 001 - GPIO pin is otput
+ * xxx - for other combinations, GPIO pin takes some alternate function */
+#define GPFSEL		0x0		/* Function Select */
+
+/* there are 2 GPSET 32bit registers, starting from offset 0x1c.
+ * Every register controls 32 pins, 1 bit per pin.
+ * 0 - no effect
+ * 1 - Set GPIO pin */
+#define GPSET		0x1c	/* Pin Output Set */
+
+/* there are 2 GPCLR 32bit registers, starting from offset 0x28.
+ * Every register controls 32 pins, 1 bit per pin.
+ * 0 - no effect
+ * 1 - Clear GPIO pin */
+#define GPCLR		0x28	/* Pin Output Clear */
+
+/* there are 2 GPCLR 32bit registers, starting from offset 0x34.
+ * Every register controls 32 pins, 1 bit per pin.
+ * 0 - GPIO pin is low
+ * 1 - GPIO pin is high */
+#define GPLEV		0x34	/* Pin Level */
+
+/* there are 2 GPEDS 32bit registers, starting from offset 0x40.
+ * Bit is set when an enabled edge is detected on the pin, and cleared by writing 1 to it. */
+#define GPEDS		0x40	/* Pin Event Detect Status */
+
+/* there are 2 GPREN and 2 GPFEN 32bit registers, starting from offsets 0x4c and 0x58.
+ * 1 - rising (GPREN) or falling (GPFEN) edge on the pin sets the GPEDS bit and raises the bank interrupt */
+#define GPREN		0x4c	/* Pin Rising Edge Detect Enable */
+#define GPFEN		0x58	/* Pin Falling Edge Detect Enable */
+
+#define GET_GPFSEL_REG_OFFSET(pin)		(GPFSEL + (((pin) / 10) * 4))
+#define GET_GPSET_REG_OFFSET(pin)		(GPSET + (((pin) / 32) * 4))
+#define GET_GPCLR_REG_OFFSET(pin)		(GPCLR + (((pin) / 32) * 4))
+#define GET_GPLEV_REG_OFFSET(pin)		(GPLEV + (((pin) / 32) * 4))
+
+#define GET_GPFSEL_PIN_OFFSET(pin)		(((pin) % 10) * 3)
+#define GET_GPSET_PIN_OFFSET(pin)		(pin)
+#define GET_GPCLR_PIN_OFFSET(pin)		(pin)
+#define GET_GPLEV_PIN_OFFSET(pin)		(pin)
+
+
+enum output_level {
+	OUTPUT_LOW,
+	OUTPUT_HIGH,
+	OUTPUT_MAX
+};
+
+enum reg_fsel {
+	REG_FSEL_GPIO_IN = 0,
+	REG_FSEL_GPIO_OUT = 1,
+	REG_FSEL_ALT0 = 4,
+	REG_FSEL_ALT1 = 5,
+	REG_FSEL_ALT2 = 6,
+	REG_FSEL_ALT3 = 7,
+	REG_FSEL_ALT4 = 3,
+	REG_FSEL_ALT5 = 2
+};
+
+/* Register block and the last seen values of GPFSEL0-5. The copy lets bus_write() skip update_fsel() when the bus pins
+ * already are outputs; it may be stale if another driver or a mapping of the registers changed pin functions. */
+struct test_gpio_regs {
+	void __iomem *base;
+	spinlock_t fsel_lock;
+	u32 fsel[NUM_GPFSEL_REGS];
+};
+
+/* Register access backend, defined by the includer */
+static inline u32 reg_read(struct test_gpio_regs *hw, int off);
+static inline void reg_write(struct test_gpio_regs *hw, u32 val, int off);
+
+/* Load the GPFSEL shadow from the (already mapped) register block */
+static inline void regs_init(struct test_gpio_regs *hw)
+{
+	int i;
+
+	spin_lock_init(&hw->fsel_lock);
+	for (i = 0; i < NUM_GPFSEL_REGS; i++)
+		hw->fsel[i] = reg_read(hw, GPFSEL + i * 4);
+}
+
+/* Drive pins in set high and pins in clear low, writing only the non-zero GPCLR0/1 and GPSET0/1 registers */
+static inline void write_levels(struct test_gpio_regs *hw, u64 set, u64 clear)
+{
+	if ((u32)clear)
+		reg_write(hw, (u32)clear, GPCLR);
+	if ((u32)(clear >> 32))
+		reg_write(hw, (u32)(clear >> 32), GPCLR + 4);
+	if ((u32)set)
+		reg_write(hw, (u32)set, GPSET);
+	if ((u32)(set >> 32))
+		reg_write(hw, (u32)(set >> 32), GPSET + 4);
+}
+
+/* Configure pins in output mask as outputs and pins in input mask as inputs.
+ * Every affected GPFSEL register is read and rewritten under fsel_lock, so concurrent callers cannot lose each other's
+ * updates, changes made outside the driver (pinctrl, gpiolib) are neither missed nor overwritten, and a register
+ * is written only when some pin really changes its function. */
+static inline void update_fsel(struct test_gpio_regs *hw, u64 output, u64 input)
+{
+	u64 pins = output | input;
+	u32 cur, val;
+	int reg, pin, pin_offset;
+	unsigned long flags;
+
+	spin_lock_irqsave(&hw->fsel_lock, flags);
+	for (reg = 0; reg < NUM_GPFSEL_REGS; reg++) {
+		if (!((pins >> (reg * 10)) & 0x3ff))
+			continue;
+
+		cur = reg_read(hw, GPFSEL + reg * 4);
+		val = cur;
+		for (pin = reg * 10; pin < reg * 10 + 10 && pin < NUM_GPIOS; pin++) {
+			if (!(pins & BIT_ULL(pin)))
+				continue;
+			pin_offset = GET_GPFSEL_PIN_OFFSET(pin);
+			/* first, cleanup all 3 pin bits, then set pin as output (001) or leave it as input (000) */
+			val &= ~(0x07 << pin_offset);
+			if (output & BIT_ULL(pin))
+				val |= (REG_FSEL_GPIO_OUT << pin_offset);
+		}
+		hw->fsel[reg] = val;
+		if (val != cur)
+			reg_write(hw, val, GPFSEL + reg * 4);
+	}
+	spin_unlock_irqrestore(&hw->fsel_lock, flags);
+}
+
+static inline int set_output(struct test_gpio_regs *hw, char pin, enum output_level out) {
+	/* RED LED is connected to GPIO17, e.g. to turn it on: */
+	// GPFSEL1, bits 23-21 -> 001 = GPIO Pin 17 is an output
+	// GPSET0, set pin 17
+	/* GREEN LED is connected to GPIO26 */
+
+	/* set pin to 0 on 1, then set pin as output (GPFSEL is only read if it already is) */
+	switch (out) {
+	case OUTPUT_LOW:
+		write_levels(hw, 0, BIT_ULL(pin));
+		break;
+
+	case OUTPUT_HIGH:
+		write_levels(hw, BIT_ULL(pin), 0);
+		break;
+
+	default:
+		/* no logging on access paths, callers get the error */
+		return -EINVAL;
+	}
+
+	update_fsel(hw, BIT_ULL(pin), 0);
+	trace_test_gpio_pin(pin, out == OUTPUT_HIGH ? TEST_GPIO_OP_HIGH : TEST_GPIO_OP_LOW, 0);
+
+	return 0;
+}
+
+static inline int set_input(struct test_gpio_regs *hw, char pin) {
+	/* e.g, Switch is connected to GPIO17, e.g. to set it as input: */
+	// GPFSEL1, bits 23-21 -> 000 = GPIO Pin 17 is an input
+	update_fsel(hw, 0, BIT_ULL(pin));
+	trace_test_gpio_pin(pin, TEST_GPIO_OP_IN, 0);
+
+	return 0;
+}
+
+/* Apply whole-bank masks with the fewest possible register writes.
+ * Output levels are latched first (GPCLR0/1, GPSET0/1, only the non-zero ones), so pins which are switched
+ * to output by the same call come up already at the requested level. Then every GPFSEL register holding
+ * at least one pin from the direction masks is rewritten once, and only if its value really changes (see update_fsel).
+ * Note that GPSET and GPCLR are separate registers, so rising and falling pins of the same bank
+ * change with one bus write between them. */
+static inline int set_masks(struct test_gpio_regs *hw, const struct test_gpio_masks *masks)
+{
+	if ((masks->set | masks->clear | masks->output | masks->input) & ~GPIO_ALL_MASK)
+		return -EINVAL;
+	if ((masks->set & masks->clear) || (masks->output & masks->input))
+		return -EINVAL;
+
+	write_levels(hw, masks->set, masks->clear);
+	update_fsel(hw, masks->output, masks->input);
+
+	return 0;
+}
+
+/* Named pin group (bus), written and read as one integer: bit i of the value is pin pins[i] of bus_init().
+ * Pins may be scattered over both banks in any order. Lookup tables translate a byte at a time:
+ * set_lut[b][v] is the mask of pins driven high when byte b of the value is v, and get_lut[b][v] the value bits
+ * of pins which are high when byte b of the 64-bit GPLEV1:GPLEV0 level is v. fsel_mask/fsel_out are the
+ * GPFSEL bits of the pins and their value when all of them are outputs. */
+#define BUS_MAX_PINS	32
+#define BUS_VALUE_BYTES	(BUS_MAX_PINS / 8)
+#define BUS_LEVEL_BYTES	((NUM_GPIOS + 7) / 8)
+
+struct test_gpio_bus {
+	u64 mask;
+	int npins;
+	u64 set_lut[BUS_VALUE_BYTES][256];
+	u32 get_lut[BUS_LEVEL_BYTES][256];
+	u32 fsel_mask[NUM_GPFSEL_REGS];
+	u32 fsel_out[NUM_GPFSEL_REGS];
+};
+
+static inline int bus_init(struct test_gpio_bus *bus, const int *pins, int npins)
+{
+	int i, b, v, pin;
+
+	if (npins < 1 || npins > BUS_MAX_PINS)
+		return -EINVAL;
+
+	memset(bus, 0, sizeof(*bus));
+	for (i = 0; i < npins; i++) {
+		pin = pins[i];
+		if (pin < 0 || pin >= NUM_GPIOS || (bus->mask & BIT_ULL(pin)))
+			return -EINVAL;
+		bus->mask |= BIT_ULL(pin);
+		bus->fsel_mask[pin / 10] |= 7 << GET_GPFSEL_PIN_OFFSET(pin);
+		bus->fsel_out[pin / 10] |= REG_FSEL_GPIO_OUT << GET_GPFSEL_PIN_OFFSET(pin);
+	}
+	bus->npins = npins;
+
+	for (b = 0; b < BUS_VALUE_BYTES; b++)
+		for (v = 0; v < 256; v++)
+			for (i = 0; i < 8 && b * 8 + i < npins; i++)
+				if (v & (1 << i))
+					bus->set_lut[b][v] |= BIT_ULL(pins[b * 8 + i]);
+
+	for (i = 0; i < npins; i++)
+		for (v = 0; v < 256; v++)
+			if (v & (1 << (pins[i] % 8)))
+				bus->get_lut[pins[i] / 8][v] |= 1U << i;
+
+	return 0;
+}
+
+/* Drive the bus to value: GPCLR0/1 and GPSET0/1 (only non-zero ones, so 2 to 4 writes however the pins
+ * are scattered), then GPFSEL only for pins which are not outputs yet */
+static inline int bus_write(struct test_gpio_regs *hw, const struct test_gpio_bus *bus, u32 value)
+{
+	u64 set = 0;
+	int b, reg;
+
+	if (bus->npins < 32 && (value >> bus->npins))
+		return -EINVAL;
+
+	for (b = 0; b * 8 < bus->npins; b++)
+		set |= bus->set_lut[b][(value >> (b * 8)) & 0xff];
+	write_levels(hw, set, bus->mask & ~set);
+
+	/* usually all pins are outputs already, checked against the shadow without taking fsel_lock */
+	for (reg = 0; reg < NUM_GPFSEL_REGS; reg++) {
+		if ((READ_ONCE(hw->fsel[reg]) & bus->fsel_mask[reg]) != bus->fsel_out[reg]) {
+			update_fsel(hw, bus->mask, 0);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* Current value of the bus pins, from one read of every GPLEV register holding one of them */
+static inline u32 bus_read(struct test_gpio_regs *hw, const struct test_gpio_bus *bus)
+{
+	u64 lev = 0;
+	u32 value = 0;
+	int b;
+
+	if ((u32)bus->mask)
+		lev = reg_read(hw, GPLEV);
+	if (bus->mask >> 32)
+		lev |= (u64)reg_read(hw, GPLEV + 4) << 32;
+
+	for (b = 0; b < BUS_LEVEL_BYTES; b++)
+		if ((bus->mask >> (b * 8)) & 0xff)
+			value |= bus->get_lut[b][(lev >> (b * 8)) & 0xff];
+	return value;
+}
+
+/* Snapshot of all GPFSEL registers and both GPLEV registers, taken in one pass */
+static inline void get_status(struct test_gpio_regs *hw, struct test_gpio_status *status)
+{
+	unsigned long flags;
+	int i;
+
+	/* Hardware is read anyway, so also resync the shadow copy, in case some other driver changed pin functions */
+	spin_lock_irqsave(&hw->fsel_lock, flags);
+	for (i = 0; i < NUM_GPFSEL_REGS; i++)
+		status->fsel[i] = hw->fsel[i] = reg_read(hw, GPFSEL + i * 4);
+	spin_unlock_irqrestore(&hw->fsel_lock, flags);
+	status->level = reg_read(hw, GPLEV) | ((u64)reg_read(hw, GPLEV + 4) << 32);
+}
+
+#endif
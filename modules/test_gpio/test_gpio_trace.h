@@ -0,0 +1,101 @@
+/* Tracepoints of the test_gpio module, in place of printk logging on the access paths.
+ * They cost a not-taken branch while disabled. Enable and capture with ftrace:
+ * 	echo 1 > /sys/kernel/debug/tracing/events/test_gpio/enable
+ * 	cat /sys/kernel/debug/tracing/trace_pipe
+ * or with perf: perf record -e 'test_gpio:*' */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM test_gpio
+
+#if !defined(_TEST_GPIO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TEST_GPIO_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Character device read()/write()/ioctl(). arg is the read/write mode, or the ioctl command. */
+#define TEST_GPIO_TRACE_READ	0
+#define TEST_GPIO_TRACE_WRITE	1
+#define TEST_GPIO_TRACE_IOCTL	2
+
+TRACE_EVENT(test_gpio_fop,
+	TP_PROTO(const char *name, int op, unsigned int arg, size_t len, long ret, u64 duration_ns),
+	TP_ARGS(name, op, arg, len, ret, duration_ns),
+
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(int, op)
+		__field(unsigned int, arg)
+		__field(size_t, len)
+		__field(long, ret)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->op = op;
+		__entry->arg = arg;
+		__entry->len = len;
+		__entry->ret = ret;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("%s %s arg=0x%x len=%zu ret=%ld duration_ns=%llu", __get_str(name),
+		  __print_symbolic(__entry->op,
+				   { TEST_GPIO_TRACE_READ, "read" },
+				   { TEST_GPIO_TRACE_WRITE, "write" },
+				   { TEST_GPIO_TRACE_IOCTL, "ioctl" }),
+		  __entry->arg, __entry->len, __entry->ret, __entry->duration_ns)
+);
+
+/* One pin command, from a write() command or a sysfs store(); op is TEST_GPIO_OP_* */
+TRACE_EVENT(test_gpio_pin,
+	TP_PROTO(unsigned int pin, int op, int ret),
+	TP_ARGS(pin, op, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, pin)
+		__field(int, op)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->pin = pin;
+		__entry->op = op;
+		__entry->ret = ret;
+	),
+
+	TP_printk("pin=%u %s ret=%d", __entry->pin,
+		  __print_symbolic(__entry->op,
+				   { TEST_GPIO_OP_LOW, "low" },
+				   { TEST_GPIO_OP_HIGH, "high" },
+				   { TEST_GPIO_OP_IN, "in" }),
+		  __entry->ret)
+);
+
+/* sysfs read of one pin: level from testgpioN/value, or 3-bit function code from testgpioN/direction */
+TRACE_EVENT(test_gpio_sysfs_show,
+	TP_PROTO(unsigned int pin, bool direction, int val),
+	TP_ARGS(pin, direction, val),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, pin)
+		__field(bool, direction)
+		__field(int, val)
+	),
+
+	TP_fast_assign(
+		__entry->pin = pin;
+		__entry->direction = direction;
+		__entry->val = val;
+	),
+
+	TP_printk("pin=%u %s=%d", __entry->pin, __entry->direction ? "direction" : "value", __entry->val)
+);
+
+#endif /* _TEST_GPIO_TRACE_H */
+
+/* This part must be outside protection, the header is looked up in the module directory (-I$(src) in Makefile) */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE test_gpio_trace
+#include <trace/define_trace.h>